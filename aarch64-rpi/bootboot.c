@@ -39,6 +39,8 @@
 #define PAGESIZE 4096
 
 #include "tinf.h"
+#include "lz4.h"
+#include "zstd.h"
 
 /* get BOOTBOOT structure */
 #include "../bootboot.h"
@@ -336,6 +338,43 @@ int hex2bin(unsigned char *s, int n){ int r=0;while(n-->0){r<<=4;
 #define EMMC_CONTROL2       ((volatile uint32_t*)(MMIO_BASE+0x0030003C))
 #define EMMC_SLOTISR_VER    ((volatile uint32_t*)(MMIO_BASE+0x003000FC))
 
+/* DMA controller, moves sectors from the EMMC data register to memory */
+#define DMA_CHANNEL         5
+#define DMA_CS              ((volatile uint32_t*)(MMIO_BASE+0x00007000+DMA_CHANNEL*0x100))
+#define DMA_CONBLK_AD       ((volatile uint32_t*)(MMIO_BASE+0x00007004+DMA_CHANNEL*0x100))
+#define DMA_DEBUG           ((volatile uint32_t*)(MMIO_BASE+0x00007020+DMA_CHANNEL*0x100))
+#define DMA_ENABLE          ((volatile uint32_t*)(MMIO_BASE+0x00007FF0))
+
+#define DMA_CS_ACTIVE       0x00000001
+#define DMA_CS_END          0x00000002
+#define DMA_CS_INT          0x00000004
+#define DMA_CS_ERROR        0x00000100
+#define DMA_CS_PRIORITY     0x00070000
+#define DMA_CS_WAIT_WRITES  0x10000000
+#define DMA_CS_ABORT        0x40000000
+#define DMA_CS_RESET        0x80000000
+
+#define DMA_TI_WAIT_RESP    0x00000008
+#define DMA_TI_DEST_INC     0x00000010
+#define DMA_TI_SRC_DREQ     0x00000400
+#define DMA_TI_PERMAP_EMMC  0x000B0000
+
+/* VideoCore bus addresses, uncached alias for RAM */
+#define DMA_BUS_MMIO(a)     ((uint32_t)((uint64_t)(a)-MMIO_BASE+0x7E000000))
+#define DMA_BUS_RAM(a)      ((uint32_t)((uint64_t)(a)|0xC0000000))
+
+typedef struct {
+    uint32_t ti;
+    uint32_t src;
+    uint32_t dst;
+    uint32_t len;
+    uint32_t stride;
+    uint32_t next;
+    uint32_t reserved[2];
+} __attribute__((packed)) dma_cb_t;
+
+volatile dma_cb_t __attribute__((aligned(32))) dma_cb;
+
 // command flags
 #define CMD_NEED_APP        0x80000000
 #define CMD_RSPNS_48        0x00020000
@@ -353,6 +392,7 @@ int hex2bin(unsigned char *s, int n){ int r=0;while(n-->0){r<<=4;
 #define CMD_READ_MULTI      0x12220032
 #define CMD_SET_BLOCKCNT    0x17020000
 #define CMD_APP_CMD         0x37000000
+#define CMD_SWITCH_FUNC     0x06220010
 #define CMD_SET_BUS_WIDTH   (0x06020000|CMD_NEED_APP)
 #define CMD_SEND_OP_COND    (0x29020000|CMD_NEED_APP)
 #define CMD_SEND_SCR        (0x33220010|CMD_NEED_APP)
@@ -367,6 +407,7 @@ int hex2bin(unsigned char *s, int n){ int r=0;while(n-->0){r<<=4;
 #define INT_DATA_TIMEOUT    0x00100000
 #define INT_CMD_TIMEOUT     0x00010000
 #define INT_READ_RDY        0x00000020
+#define INT_DATA_DONE       0x00000002
 #define INT_CMD_DONE        0x00000001
 
 #define INT_ERROR_MASK      0x017E8000
@@ -394,6 +435,7 @@ int hex2bin(unsigned char *s, int n){ int r=0;while(n-->0){r<<=4;
 #define HOST_SPEC_V1        0
 
 // SCR flags
+#define SCR_SD_SPEC         0x0000000F
 #define SCR_SD_BUS_WIDTH_4  0x00000400
 #define SCR_SUPP_SET_BLKCNT 0x02000000
 // added by my driver
@@ -404,11 +446,23 @@ int hex2bin(unsigned char *s, int n){ int r=0;while(n-->0){r<<=4;
 #define ACMD41_CMD_CCS      0x40000000
 #define ACMD41_ARG_HC       0x51ff8000
 
+// CMD6 arguments and status bits, group 1 is access mode
+#define SWITCH_CHECK_HS     0x00FFFFF1
+#define SWITCH_SET_HS       0x80FFFFF1
+#define SWITCH_SUPP_HS      0x00000200  /* status word 3 */
+#define SWITCH_FUNC_MASK    0x0000000F  /* status word 4 */
+
+#define SD_BASE_CLOCK       250000000   /* if the firmware does not tell */
+
 #define SD_OK                0
 #define SD_TIMEOUT          -1
 #define SD_ERROR            -2
 
-uint32_t sd_scr[2], sd_ocr, sd_rca, sd_err, sd_hv;
+uint32_t sd_scr[2], sd_ocr, sd_rca, sd_err, sd_hv, sd_base=SD_BASE_CLOCK;
+/* read in flight, started by sd_readstart() and finished by sd_readwait() */
+uint64_t sd_lba;
+uint8_t *sd_buf;
+uint32_t sd_num, sd_dma=1, sd_dmaon;
 
 /**
  * Wait for data or command ready
@@ -469,32 +523,105 @@ int sd_cmd(uint32_t code, uint32_t arg)
 }
 
 /**
- * read a block from sd card and return the number of bytes read
- * returns 0 on error.
+ * send the read command for sd_lba. Polled reads of non-CCS cards send one per block
  */
-int sd_readblock(uint64_t lba, uint8_t *buffer, uint32_t num)
+int sd_readcmd(uint32_t num)
 {
-    int r,c=0,d;
-    if(num<1) num=1;
-#if SD_DEBUG
-    uart_puts("sd_readblock lba ");uart_hex(lba,4);uart_puts(" num ");uart_hex(num,4);uart_putc('\n');
-#endif
     if(sd_status(SR_DAT_INHIBIT)) {sd_err=SD_TIMEOUT; return 0;}
-    uint32_t *buf=(uint32_t *)buffer;
     if(sd_scr[0] & SCR_SUPP_CCS) {
         if(num > 1 && (sd_scr[0] & SCR_SUPP_SET_BLKCNT)) {
             sd_cmd(CMD_SET_BLOCKCNT,num);
             if(sd_err) return 0;
         }
         *EMMC_BLKSIZECNT = (num << 16) | 512;
-        sd_cmd(num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI,lba);
-        if(sd_err) return 0;
+        sd_cmd(num == 1 ? CMD_READ_SINGLE : CMD_READ_MULTI,sd_lba);
     } else {
         *EMMC_BLKSIZECNT = (1 << 16) | 512;
     }
+    return sd_err==SD_OK;
+}
+
+/**
+ * start reading blocks from sd card. With DMA the transfer runs in the background,
+ * and the caller is free to do something else until sd_readwait()
+ */
+int sd_readstart(uint64_t lba, uint8_t *buffer, uint32_t num)
+{
+    if(num<1) num=1;
+#if SD_DEBUG
+    uart_puts("sd_readblock lba ");uart_hex(lba,4);uart_puts(" num ");uart_hex(num,4);uart_putc('\n');
+#endif
+    sd_lba=lba; sd_buf=buffer; sd_num=num; sd_err=SD_OK;
+    // BLKSIZECNT has a 16 bit block counter, larger reads are split in sd_readwait()
+    if(num > 65535) num=65535;
+    sd_dmaon=sd_dma && (sd_scr[0] & SCR_SUPP_CCS) && !((uint64_t)buffer & 3) &&
+        (uint64_t)buffer+num*512 <= MMIO_BASE;
+    if(sd_dmaon) {
+        // arm the channel before the command, the data register paces it with DREQ
+        dma_cb.ti=DMA_TI_PERMAP_EMMC|DMA_TI_SRC_DREQ|DMA_TI_DEST_INC|DMA_TI_WAIT_RESP;
+        dma_cb.src=DMA_BUS_MMIO(EMMC_DATA);
+        dma_cb.dst=DMA_BUS_RAM(buffer);
+        dma_cb.len=num*512;
+        dma_cb.stride=dma_cb.next=0;
+        *DMA_ENABLE |= 1<<DMA_CHANNEL;
+        *DMA_CS=DMA_CS_RESET; delaym(1);
+        *DMA_DEBUG=7;
+        *DMA_CONBLK_AD=DMA_BUS_RAM(&dma_cb);
+        asm volatile("dsb sy");
+        *DMA_CS=DMA_CS_WAIT_WRITES|DMA_CS_PRIORITY|DMA_CS_ACTIVE;
+    }
+    if(!sd_readcmd(num)) {
+        if(sd_dmaon) *DMA_CS=DMA_CS_RESET;
+        sd_dmaon=0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * wait for the DMA engine to finish, returns non-zero on error
+ */
+int sd_dmawait()
+{
+    uint32_t r;
+    int cnt = 1000000; while((*DMA_CS & DMA_CS_ACTIVE) && !(*DMA_CS & DMA_CS_ERROR) &&
+        !(*EMMC_INTERRUPT & INT_ERROR_MASK) && cnt--) delaym(1);
+    r=*DMA_CS;
+    if(cnt<=0 || (r & DMA_CS_ERROR) || !(r & DMA_CS_END) || sd_int(INT_DATA_DONE)) {
+        *DMA_CS=DMA_CS_ABORT; delaym(1); *DMA_CS=DMA_CS_RESET;
+        // drop whatever is left in the data line, so that the card can be read with polling
+        *EMMC_CONTROL1 |= C1_SRST_DATA;
+        cnt=10000; do{delaym(10);} while( (*EMMC_CONTROL1 & C1_SRST_DATA) && cnt-- );
+        return SD_ERROR;
+    }
+    *DMA_CS=DMA_CS_END|DMA_CS_INT;
+    return SD_OK;
+}
+
+/**
+ * finish the read started by sd_readstart() and return the number of bytes read
+ * returns 0 on error.
+ */
+int sd_readwait()
+{
+    int r,d;
+    uint32_t c=0, num=sd_num>65535?65535:sd_num;
+    uint32_t *buf=(uint32_t *)sd_buf;
+    if(sd_err) return 0;
+    if(sd_dmaon) {
+        sd_dmaon=0;
+        if(sd_dmawait()) {
+            // fall back to polling for the rest of the boot
+            DBG("BOOTBOOT-ERROR: SD DMA failed, using polling\n");
+            sd_dma=0;
+            if(num > 1) sd_cmd(CMD_STOP_TRANS,0);
+            if(!sd_readcmd(num)) return 0;
+        } else
+            c=num;
+    }
     while( c < num ) {
         if(!(sd_scr[0] & SCR_SUPP_CCS)) {
-            sd_cmd(CMD_READ_SINGLE,(lba+c)*512);
+            sd_cmd(CMD_READ_SINGLE,(sd_lba+c)*512);
             if(sd_err) return 0;
         }
         if((r=sd_int(INT_READ_RDY))){DBG("\rBOOTBOOT-ERROR: Timeout waiting for ready to read\n");sd_err=r;return 0;}
@@ -502,10 +629,46 @@ int sd_readblock(uint64_t lba, uint8_t *buffer, uint32_t num)
         c++; buf+=128;
     }
 #if SD_DEBUG
-    uart_dump(buffer,4);
+    uart_dump(sd_buf,4);
 #endif
     if( num > 1 && !(sd_scr[0] & SCR_SUPP_SET_BLKCNT) && (sd_scr[0] & SCR_SUPP_CCS)) sd_cmd(CMD_STOP_TRANS,0);
-    return sd_err!=SD_OK || c!=num? 0 : num*512;
+    if(sd_err!=SD_OK || c!=num) return 0;
+    if(sd_num > num) {
+        // read the remaining blocks
+        if(!sd_readstart(sd_lba+num, sd_buf+num*512, sd_num-num) || !(r=sd_readwait())) return 0;
+        return num*512+r;
+    }
+    return num*512;
+}
+
+/**
+ * read a block from sd card and return the number of bytes read
+ * returns 0 on error.
+ */
+int sd_readblock(uint64_t lba, uint8_t *buffer, uint32_t num)
+{
+    if(!sd_readstart(lba,buffer,num)) return 0;
+    return sd_readwait();
+}
+
+/**
+ * query or set a card function with CMD6 and read the 512 bit status
+ */
+int sd_switch(uint32_t arg, uint32_t *status)
+{
+    int r=0, cnt=100000;
+    if(sd_status(SR_DAT_INHIBIT)) return SD_TIMEOUT;
+    *EMMC_BLKSIZECNT = (1<<16) | 64;
+    sd_cmd(CMD_SWITCH_FUNC,arg);
+    if(sd_err) return sd_err;
+    if(sd_int(INT_READ_RDY)) return SD_TIMEOUT;
+    while(r<16 && cnt--) {
+        if( *EMMC_STATUS & SR_READ_AVAILABLE )
+            status[r++] = *EMMC_DATA;
+        else
+            delaym(1);
+    }
+    return r==16 ? SD_OK : SD_TIMEOUT;
 }
 
 /**
@@ -513,7 +676,7 @@ int sd_readblock(uint64_t lba, uint8_t *buffer, uint32_t num)
  */
 int sd_clk(uint32_t f)
 {
-    uint32_t d,c=41666666/f,x,s=32,h=0;
+    uint32_t d,c,h=0;
     int cnt = 100000;
     while((*EMMC_STATUS & (SR_CMD_INHIBIT|SR_DAT_INHIBIT)) && cnt--) delaym(1);
     if(cnt<=0) {
@@ -522,19 +685,12 @@ int sd_clk(uint32_t f)
     }
 
     *EMMC_CONTROL1 &= ~C1_CLK_EN; delaym(10);
-    x=c-1; if(!x) s=0; else {
-        if(!(x & 0xffff0000u)) { x <<= 16; s -= 16; }
-        if(!(x & 0xff000000u)) { x <<= 8;  s -= 8; }
-        if(!(x & 0xf0000000u)) { x <<= 4;  s -= 4; }
-        if(!(x & 0xc0000000u)) { x <<= 2;  s -= 2; }
-        if(!(x & 0x80000000u)) { x <<= 1;  s -= 1; }
-        if(s>0) s--;
-        if(s>7) s=7;
-    }
-    if(sd_hv>HOST_SPEC_V2) d=c; else d=(1<<s);
-    if(d<=2) {d=2;s=0;}
+    // the controller divides the base clock by 2*d, pick the smallest d not exceeding f
+    c=(sd_base+2*f-1)/(2*f);
+    if(sd_hv>HOST_SPEC_V2) d=c>0x3ff?0x3ff:c; else for(d=1;d<c && d<0x80;d<<=1);
+    if(d<2) d=2;
 #if SD_DEBUG
-    uart_puts("sd_clk divisor ");uart_hex(d,4);uart_puts(", shift ");uart_hex(s,4);uart_putc('\n');
+    uart_puts("sd_clk base ");uart_hex(sd_base,4);uart_puts(", divisor ");uart_hex(d,4);uart_putc('\n');
 #endif
     if(sd_hv>HOST_SPEC_V2) h=(d&0x300)>>2;
     d=(((d&0x0ff)<<8)|h);
@@ -553,7 +709,8 @@ int sd_clk(uint32_t f)
  */
 int sd_init()
 {
-    long r,cnt,ccs=0;
+    long r,cnt,ccs=0,hs;
+    uint32_t sw[16];
     // GPIO_CD
     r=*GPFSEL4; r&=~(7<<(7*3)); *GPFSEL4=r;
     *GPPUD=2; delay(150); *GPPUDCLK1=(1<<15); delay(150); *GPPUD=0; *GPPUDCLK1=0;
@@ -585,6 +742,16 @@ int sd_init()
 #endif
     *EMMC_CONTROL1 |= C1_CLK_INTLEN | C1_TOUNIT_MAX;
     delaym(10);
+    // ask the firmware about the base clock of the EMMC
+    mbox[0] = 8*4;
+    mbox[1] = MBOX_REQUEST;
+    mbox[2] = 0x30002;  //get clock rate
+    mbox[3] = 8;
+    mbox[4] = 8;
+    mbox[5] = 1;        //EMMC
+    mbox[6] = 0;
+    mbox[7] = 0;
+    if(mbox_call(MBOX_CH_PROP,mbox) && mbox[6]) sd_base=mbox[6];
     // Set clock to setup frequency.
     if((r=sd_clk(400000))) return r;
     *EMMC_INT_EN   = 0xffffffff;
@@ -646,11 +813,6 @@ int sd_init()
             delaym(1);
     }
     if(r!=2) return SD_TIMEOUT;
-    if(sd_scr[0] & SCR_SD_BUS_WIDTH_4) {
-        sd_cmd(CMD_SET_BUS_WIDTH,sd_rca|2);
-        if(sd_err) return sd_err;
-        *EMMC_CONTROL0 |= C0_HCTL_DWITDH;
-    }
     // add software flag
 #ifdef SD_DEBUG
     uart_puts("EMMC: supports ");
@@ -660,8 +822,30 @@ int sd_init()
         uart_puts("CCS ");
     uart_putc('\n');
 #endif
+    hs=sd_scr[0] & SCR_SD_SPEC;
     sd_scr[0]&=~SCR_SUPP_CCS;
     sd_scr[0]|=ccs;
+    if(sd_scr[0] & SCR_SD_BUS_WIDTH_4) {
+        sd_cmd(CMD_SET_BUS_WIDTH,sd_rca|2);
+        if(sd_err) sd_scr[0]&=~SCR_SD_BUS_WIDTH_4;
+        else *EMMC_CONTROL0 |= C0_HCTL_DWITDH;
+    }
+    // switch to High Speed if the card is at least SD 1.10 and supports it
+    if(hs && !sd_switch(SWITCH_CHECK_HS,sw) && (sw[3] & SWITCH_SUPP_HS) && (sw[4] & SWITCH_FUNC_MASK)==1 &&
+        !sd_switch(SWITCH_SET_HS,sw) && (sw[4] & SWITCH_FUNC_MASK)==1) {
+        // card needs 8 clocks to switch, then check that it can be read at 50 MHz
+        delaym(10);
+        *EMMC_CONTROL0 |= C0_HCTL_HS_EN;
+        if(sd_clk(50000000) || !sd_readblock(0,(uint8_t*)&__diskbuf,1)) {
+            *EMMC_CONTROL0 &= ~C0_HCTL_HS_EN;
+            if((r=sd_clk(25000000))) return r;
+            hs=0;
+        }
+    } else
+        hs=0;
+    puts(" * SD card ");
+    puts(sd_scr[0] & SCR_SD_BUS_WIDTH_4 ? "4 bit" : "1 bit");
+    puts(hs ? ", High Speed 50 MHz\n" : ", Default Speed 25 MHz\n");
     return SD_OK;
 }
 
@@ -716,6 +900,105 @@ typedef struct {
     uint32_t    size;
 } __attribute__((packed)) fatdir_t;
 
+/* FAT sector cache, filled on demand while following cluster chains */
+#define FAT_CACHE       8   /* sectors in the cache */
+#define FAT_PREFETCH    1   /* sectors read ahead on a miss, chains mostly go forward */
+#define FAT_CHUNK       (1024*1024) /* at most this much is read at once from a file */
+uint8_t *fat_cache;
+uint64_t fat_lba, fat_tag[FAT_CACHE];
+uint32_t fat_slot;
+/* file being read by fat_readnext() and fat_readwait(), run after run into one buffer */
+volatile bpb_t *fat_bpb;
+uint64_t fat_data;
+uint32_t fat_clu, fat_left, fat_pend;
+uint8_t *fat_ptr;
+
+/**
+ * set up an empty FAT cache in buf for the FAT starting at lba
+ */
+void fat_init(uint64_t lba, uint8_t *buf)
+{
+    uint32_t i;
+    fat_lba=lba; fat_cache=buf; fat_slot=0;
+    for(i=0;i<FAT_CACHE;i++) fat_tag[i]=-1;
+}
+
+/**
+ * get a FAT entry, reading the sector it's in if it's not in the cache.
+ * Returns 0 (a free cluster, never part of a chain) if the sector can't be read
+ */
+uint32_t fat_get(volatile bpb_t *bpb, uint32_t clu)
+{
+    uint64_t lba;
+    uint32_t i, o;
+    o=bpb->spf16>0?clu*2:clu*4;
+    lba=fat_lba+o/512;
+    o&=511;
+    for(i=0;i<FAT_CACHE && fat_tag[i]!=lba;i++);
+    if(i==FAT_CACHE) {
+        // replace the oldest group of sectors
+        i=fat_slot;
+        fat_slot=(fat_slot+1+FAT_PREFETCH)%FAT_CACHE;
+        // the slots are overwritten even if the read fails, don't let them hit
+        for(o=0;o<=FAT_PREFETCH;o++) fat_tag[i+o]=-1;
+        if(!sd_readblock(lba,fat_cache+i*512,1+FAT_PREFETCH)) return 0;
+        for(o=0;o<=FAT_PREFETCH;o++) fat_tag[i+o]=lba+o;
+        o=bpb->spf16>0?clu*2:clu*4;
+        o&=511;
+    }
+    return bpb->spf16>0?*((uint16_t*)(fat_cache+i*512+o)):*((uint32_t*)(fat_cache+i*512+o))&0x0FFFFFFF;
+}
+
+/**
+ * merge consecutive clusters starting at *clu into one run of at most max bytes.
+ * Returns the length of the run and sets *clu to the cluster after it, or 0 if
+ * *clu is not a data cluster (end of chain too early, or the FAT couldn't be read)
+ */
+uint32_t fat_run(volatile bpb_t *bpb, uint32_t *clu, uint32_t max)
+{
+    uint32_t c=*clu, n=bpb->spc*512, next;
+    if(c<2 || c>=(bpb->spf16>0?0xFFF7:0x0FFFFFF7))
+        return 0;
+    while(1) {
+        next=fat_get(bpb,c);
+        if(n>=max || next!=c+1) break;
+        c=next; n+=bpb->spc*512;
+    }
+    *clu=next;
+    return n>max?max:n;
+}
+
+/**
+ * start reading the next run of the file to fat_ptr. The FAT lookup is done before the
+ * transfer, as the card can't do both. Returns 0 on error, fat_left tells if it's the end
+ */
+int fat_readnext()
+{
+    uint32_t c=fat_clu, s;
+    fat_pend=0;
+    if(!fat_left) return 1;
+    s=fat_run(fat_bpb,&fat_clu,fat_left<FAT_CHUNK?fat_left:FAT_CHUNK);
+    if(s==0 || !sd_readstart(fat_data+(c-2)*fat_bpb->spc,fat_ptr,(s+511)/512)) return 0;
+    fat_pend=s;
+    return 1;
+}
+
+/**
+ * wait for the run in flight and start reading the next one, so that it arrives while
+ * the caller uses this one. Returns the number of bytes arrived, 0 at the end of the
+ * file or on error. If fat_left is not 0 after that, the file could not be read
+ */
+uint32_t fat_readwait()
+{
+    uint32_t s=fat_pend;
+    fat_pend=0;
+    if(!s || !sd_readwait()) return 0;
+    fat_ptr+=s;
+    fat_left-=s;
+    fat_readnext();
+    return s;
+}
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -736,6 +1019,8 @@ extern volatile unsigned char _binary_font_psf_start;
 file_t env;         // environment file descriptor
 file_t initrd;      // initrd file descriptor
 file_t core;        // kernel file descriptor
+#define COREPAGES 509   // pages between the environment and the stack at -2M
+uint8_t *coremap[COREPAGES]; // physical address of each core page
 BOOTBOOT *bootboot; // the BOOTBOOT structure
 
 // default environment variables. M$ states that 1024x768 must be supported
@@ -746,6 +1031,25 @@ unsigned char *kne;
 // alternative environment name
 char *cfgname="sys/config";
 
+// compressed initrds are loaded here, so that they can be uncompressed to &_end
+#define INITRD_HIGH ((uint8_t*)&_end+INITRD_MAXSIZE*1024*1024)
+// scratch area for the boot sector, FAT cache and directories
+#define FATBUF ((uint8_t*)&_end+2*INITRD_MAXSIZE*1024*1024)
+
+// concatenated gzip members, inflated on all cores
+#define GZ_MAXMEMBERS 256
+#define GZ_MAXRATIO 1032                            // best possible deflate compression ratio
+uint8_t *gzmember[GZ_MAXMEMBERS+1];         // member headers and the end of the last one
+uint8_t *gzdest[GZ_MAXMEMBERS];             // final position of each member's output
+volatile int32_t gzstatus[GZ_MAXMEMBERS];   // 0 pending, 2 inflating, 1 inflated, -1 error
+volatile uint8_t gzwant[GZ_MAXMEMBERS][2];  // Peterson's lock for claiming a member,
+volatile uint8_t gzturn[GZ_MAXMEMBERS];     // between its own core and the boot core
+int gznum;
+extern volatile uint64_t ap_worker;         // in boot.S, the other cores call it when set
+extern volatile uint8_t ap_ready[4];        // in boot.S, set by the other cores once started
+extern void _start();
+#define AP_RELEASE(i) ((volatile uint64_t*)(uint64_t)(0xd8+(i)*8)) // armstub's spin table
+
 /* current cursor position */
 int kx, ky;
 /* maximum coordinates */
@@ -939,13 +1243,304 @@ void ParseEnvironment(uint8_t *env)
     }
 }
 
+/* gzip functions */
+/**
+ * skip a gzip header, returns pointer to the deflate stream
+ */
+uint8_t *gzip_data(uint8_t *ptr)
+{
+    uint8_t f;
+    if(ptr[0]!=0x1f || ptr[1]!=0x8b || ptr[2]!=8)
+        return NULL;
+    f=ptr[3]; ptr+=10;
+    if(f&4) { ptr+=ptr[0]+(ptr[1]<<8)+2; }
+    if(f&8) { while(*ptr++ != 0); }
+    if(f&16) { while(*ptr++ != 0); }
+    if(f&2) ptr+=2;
+    return ptr;
+}
+
+/**
+ * find the next gzip member header from ptr on, start is the previous member's. This
+ * may give false positives in compressed data, so the trailer before a header must
+ * hold a size the previous member can inflate to
+ */
+uint8_t *gzip_next(uint8_t *start, uint8_t *ptr, uint8_t *end)
+{
+    uint64_t w;
+    uint32_t l;
+    for(;ptr+18<=end;ptr++) {
+        // skip aligned words without 0x1f bytes
+        if(!((uint64_t)ptr&7)) {
+            w=*((uint64_t*)ptr)^0x1f1f1f1f1f1f1f1fUL;
+            if(!((w-0x0101010101010101UL)&~w&0x8080808080808080UL)) { ptr+=7; continue; }
+        }
+        if(ptr[0]==0x1f && ptr[1]==0x8b && ptr[2]==8 && !(ptr[3]&0xE0) &&
+            (ptr[8]==0 || ptr[8]==2 || ptr[8]==4) && (ptr[9]<=13 || ptr[9]==255)) {
+            memcpy(&l,ptr-4,4);
+            if((uint64_t)l<=(uint64_t)(ptr-start)*GZ_MAXRATIO)
+                return ptr;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * inflate one gzip member straight to its final position
+ */
+int32_t gzip_member(int i)
+{
+    volatile TINF_DATA d;
+    uint8_t *end=gzmember[i+1]-8;
+    uint32_t len, crc;
+
+    d.source=gzip_data(gzmember[i]);
+    if(d.source==NULL || d.source>=end)
+        return -1;
+    d.source_limit=end;
+    memcpy(&crc,end,4);
+    memcpy(&len,end+4,4);
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.checksum_type = TINF_CHKSUM_CRC;
+    d.checksum = ~0;
+    if(uzlib_uncompress_buf(&d, gzdest[i], len)!=TINF_DONE || d.dest!=gzdest[i]+len || ~d.checksum!=crc)
+        return -1;
+    return 1;
+}
+
+/**
+ * claim a pending gzip member for a core. Only the member's own core and the boot
+ * core may race for it. With the MMU off memory is Device type, where exclusive
+ * load / store needs a global monitor the BCM2837 lacks, so instead of a compare
+ * and swap this is settled with Peterson's algorithm, which only needs barriers
+ */
+int gzip_claim(int i, uint64_t core)
+{
+    int me=core?1:0, r;
+    gzwant[i][me]=1;
+    gzturn[i]=!me;
+    asm volatile("dmb sy");
+    while(gzwant[i][!me] && gzturn[i]==!me);
+    r=!gzstatus[i];
+    if(r) gzstatus[i]=2;
+    asm volatile("dmb sy");
+    gzwant[i][me]=0;
+    return r;
+}
+
+/**
+ * inflate pending gzip members. Core N starts with every 4th member from N, and
+ * the boot core also takes over the ones that were not started by the others
+ */
+void gzip_worker(uint64_t core)
+{
+    int i, r;
+    for(i=core;i<gznum;i+=4)
+        if(gzip_claim(i,core)) {
+            r=gzip_member(i);
+            // output must be visible before the status
+            asm volatile("dmb sy");
+            gzstatus[i]=r;
+        }
+    if(!core)
+        for(i=0;i<gznum;i++)
+            if(gzip_claim(i,core)) {
+                r=gzip_member(i);
+                asm volatile("dmb sy");
+                gzstatus[i]=r;
+            }
+}
+
+/**
+ * inflate concatenated gzip members (like "cat a.gz b.gz") on all cores. Returns
+ * the uncompressed size, or 0 if initrd is not such an image, in which case it
+ * should be inflated as a single member
+ */
+uint32_t gzip_parallel()
+{
+    uint8_t *ptr, *end=initrd.ptr+initrd.size, *dst;
+    uint64_t len=0;
+    uint32_t l;
+    int i;
+
+    // look for member headers. False positives will fail the crc check below
+    // and we fall back to a single member
+    gzmember[0]=initrd.ptr; gznum=1;
+    for(ptr=initrd.ptr+18;(ptr=gzip_next(gzmember[gznum-1],ptr,end))!=NULL;ptr+=18) {
+        if(gznum>=GZ_MAXMEMBERS)
+            return 0;
+        gzmember[gznum++]=ptr;
+    }
+    if(gznum<2)
+        return 0;
+    gzmember[gznum]=end;
+    for(i=0;i<gznum;i++) {
+        memcpy(&l,gzmember[i+1]-4,4);
+        len+=l;
+    }
+    // same placement as for a single member
+    if((uint8_t*)&_end+len<initrd.ptr)
+        dst=(uint8_t*)&_end;
+    else
+        dst=(uint8_t*)((uint64_t)(end+PAGESIZE-1)&~(PAGESIZE-1));
+    if(len==0 || len>(uint64_t)initrd.size*GZ_MAXRATIO || dst+len>=(uint8_t*)MMIO_BASE)
+        return 0;
+    for(ptr=dst,i=0;i<gznum;i++) {
+        gzdest[i]=ptr; gzstatus[i]=0;
+        gzwant[i][0]=gzwant[i][1]=0;
+        memcpy(&l,gzmember[i+1]-4,4);
+        ptr+=l;
+    }
+
+    // with the stock firmware the other cores wait in the armstub's spin table,
+    // send them to _start. Those that started with us are in boot.S already
+    for(i=1;i<4;i++)
+        if(!ap_ready[i])
+            *AP_RELEASE(i)=(uint64_t)&_start;
+    // wake up the other cores and do our part. The ones that are late or
+    // never come leave their members to the boot core
+    DBG(" * Inflating gzip members on all cores\n");
+    ap_worker=(uint64_t)gzip_worker;
+    asm volatile("dsb sy; sev");
+    gzip_worker(0);
+    for(i=0;i<gznum;i++)
+        while(gzstatus[i]==2);
+    asm volatile("dmb sy");
+    // park them in a spin table of our own, so the kernel can start them
+    ap_worker=-1;
+    asm volatile("dsb sy; sev");
+    if(!ap_ready[1] && !ap_ready[2] && !ap_ready[3])
+        DBG(" * Other cores did not start, inflated on the boot core\n");
+
+    for(i=0;i<gznum;i++)
+        if(gzstatus[i]!=1)
+            return 0;
+    initrd.ptr=dst;
+    return len;
+}
+
+/**
+ * inflater's readSource callback, called when the arrived runs are consumed. The next
+ * run follows them in memory. Past the end of the file or on a read error it feeds
+ * zeros, counted as overrun
+ */
+unsigned char gzip_source(volatile TINF_DATA *d)
+{
+    uint32_t s=fat_readwait();
+    if(!s) {
+        d->source=d->source_limit;
+        d->overrun++;
+        return 0;
+    }
+    d->source_limit+=s;
+    return *d->source++;
+}
+
+/**
+ * inflate a gzip initrd being read from FAT to &_end, while its next run is read with
+ * DMA. Returns the uncompressed size when it's done and the whole file is read, or 0
+ * if it's not a single member that fits, and then it's inflated from the loaded image
+ */
+uint32_t gzip_stream()
+{
+    volatile TINF_DATA d;
+    uint32_t len, crc;
+    int r;
+
+    // several members are inflated in parallel later. Only the first run is checked,
+    // if the first member is longer, the work done on it is lost
+    d.source=gzip_data(initrd.ptr);
+    if(d.source==NULL || d.source>=fat_ptr || gzip_next(initrd.ptr,initrd.ptr+18,fat_ptr)!=NULL)
+        return 0;
+    d.source_limit=fat_ptr;
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.readSource=gzip_source;
+    d.checksum_type = TINF_CHKSUM_CRC;
+    d.checksum = ~0;
+    puts(" * Inflating image...\r");
+    r = uzlib_uncompress_buf(&d, (uint8_t*)&_end, INITRD_HIGH-(uint8_t*)&_end);
+    puts("                     \r");
+    // the trailer is in the last run
+    while(fat_readwait());
+    if(fat_left) return 0;
+    memcpy(&crc,initrd.ptr+initrd.size-8,4);
+    memcpy(&len,initrd.ptr+initrd.size-4,4);
+    if(r!=TINF_DONE || d.dest!=(uint8_t*)&_end+len || ~d.checksum!=crc)
+        return 0;
+    return len;
+}
+
+/**
+ * returns where to load an initrd by it's magic bytes. Raw images go straight to
+ * their final position, compressed ones high enough to be uncompressed there
+ */
+uint8_t *initrd_dest(uint8_t *ptr)
+{
+    if((ptr[0]==0x1F && ptr[1]==0x8B) ||
+        (ptr[0]==0x04 && ptr[1]==0x22 && ptr[2]==0x4D && ptr[3]==0x18) ||
+        (ptr[0]==0x28 && ptr[1]==0xB5 && ptr[2]==0x2F && ptr[3]==0xFD))
+        return INITRD_HIGH;
+    return (uint8_t*)&_end;
+}
+
+/**
+ * address of a kernel page in the initrd if it can be mapped in place, NULL if not
+ */
+uint8_t *core_page(uint8_t *file, uint64_t offs)
+{
+    uint8_t *ptr=file+offs;
+#ifdef _FS_Z_H_
+    if(fszfrag!=NULL) {
+        ptr=fsz_offset((unsigned char*)bootboot->initrd_ptr,fszfrag,offs);
+        if(ptr==NULL || fsz_offset((unsigned char*)bootboot->initrd_ptr,fszfrag,offs+PAGESIZE-1)!=ptr+PAGESIZE-1)
+            return NULL;
+    }
+#endif
+    return ((uint64_t)ptr&(PAGESIZE-1))?NULL:ptr;
+}
+
+/**
+ * copy part of the kernel file
+ */
+void core_read(uint8_t *dst, uint8_t *file, uint64_t offs, uint64_t len)
+{
+#ifdef _FS_Z_H_
+    if(fszfrag!=NULL) {
+        fsz_read((unsigned char*)bootboot->initrd_ptr,fszfrag,dst,offs,len);
+        return;
+    }
+#endif
+    memcpy(dst,file+offs,len);
+}
+
+/**
+ * find the next possible start of an executable, checks 8 bytes at a time
+ * for the first byte of the ELF, OS/Z and MZ magics
+ */
+#define HASZERO(v) (((v)-0x0101010101010101UL)&~(v)&0x8080808080808080UL)
+#define HASBYTE(v,b) HASZERO((v)^(0x0101010101010101UL*(b)))
+#define ISMAGIC(c) ((c)==0x7F || (c)=='O' || (c)=='M')
+uint8_t *next_executable(uint8_t *ptr, uint8_t *end)
+{
+    uint64_t w;
+    for(;ptr<end && ((uint64_t)ptr&7);ptr++)
+        if(ISMAGIC(*ptr)) return ptr;
+    for(;ptr+8<=end;ptr+=8) {
+        w=*((uint64_t*)ptr);
+        if(HASBYTE(w,0x7F) || HASBYTE(w,'O') || HASBYTE(w,'M')) break;
+    }
+    for(;ptr<end;ptr++)
+        if(ISMAGIC(*ptr)) return ptr;
+    return end;
+}
+
 /**
  * bootboot entry point
  */
 int bootboot_main(uint64_t hcl)
 {
-    uint8_t *pe,bkp=0;
-    uint32_t np,sp,r,pa,mp;
+    uint8_t *pe,*coretail,*corefile,bkp=0;
+    uint32_t np,sp,r,pa,mp,tailpages,gzlen=0;
     efipart_t *part;
     volatile bpb_t *bpb;
     uint64_t entrypoint=0, bss=0, *paging, reg;
@@ -1043,7 +1638,11 @@ int bootboot_main(uint64_t hcl)
         if(sp>0 && sp<INITRD_MAXSIZE*1024*1024) {
             uart_puts("OK");
             initrd.size=sp;
-            initrd.ptr=pe=(uint8_t*)&_end;
+            // receive the magic first to know where to put the rest
+            mp=0;
+            for(r=0;r<4 && r<sp;r++) ((uint8_t*)&mp)[r]=uart_getc();
+            initrd.ptr=pe=initrd_dest((uint8_t*)&mp);
+            memcpy(pe,&mp,r); pe+=r; sp-=r;
             while(sp--) *pe++ = uart_getc();
             goto gotinitrd;
         }
@@ -1095,7 +1694,7 @@ diskerr:
         }
     }
     if(part==NULL || r>=np) goto diskerr;
-    r=sd_readblock(part->start,(unsigned char*)&_end,1);
+    r=sd_readblock(part->start,FATBUF,1);
     if(r==0) goto diskerr;
     initrd.ptr=NULL; initrd.size=0;
     // wait keypress with timeout
@@ -1110,13 +1709,11 @@ diskerr:
         bkp=1;
     }
     //is it a FAT partition?
-    bpb=(bpb_t*)&_end;
+    bpb=(bpb_t*)FATBUF;
     if(!memcmp((void*)bpb->fst,"FAT16",5) || !memcmp((void*)bpb->fst2,"FAT32",5)) {
         // locate BOOTBOOT directory
-        uint32_t data_sec, root_sec, clu=0, s, s2;
+        uint32_t data_sec, root_sec, clu=0, c, s, s2;
         fatdir_t *dir;
-        uint32_t *fat32=(uint32_t*)((uint8_t*)&_end+bpb->rsc*512);
-        uint16_t *fat16=(uint16_t*)fat32;
         uint8_t *ptr;
         data_sec=root_sec=((bpb->spf16?bpb->spf16:bpb->spf32)*bpb->nf)+bpb->rsc;
         //WARNING gcc generates a code for bpb->nr that cause unaligned exception
@@ -1129,10 +1726,9 @@ diskerr:
         } else {
             root_sec+=(bpb->rc-2)*bpb->spc;
         }
-        // load fat table
-        r=sd_readblock(part->start+1,(unsigned char*)&_end+512,(bpb->spf16?bpb->spf16:bpb->spf32)+bpb->rsc);
-        if(r==0) goto diskerr;
-        pe=(uint8_t*)&_end+512+r;
+        // fat table is read on demand
+        fat_init(part->start+bpb->rsc,FATBUF+512);
+        pe=FATBUF+512+FAT_CACHE*512;
         // load root directory
         r=sd_readblock(part->start+root_sec,(unsigned char*)pe,s/512+1);
         dir=(fatdir_t*)pe;
@@ -1148,9 +1744,11 @@ diskerr:
                 clu=dir->cl+(dir->ch<<16);
                 ptr=(void*)&__environment;
                 while(s>0) {
-                    s2=s>bpb->spc*512?bpb->spc*512:s;
-                    r=sd_readblock(part->start+(clu-2)*bpb->spc+data_sec,ptr,s2<512?1:s2/512);
-                    clu=bpb->spf16>0?fat16[clu]:fat32[clu];
+                    c=clu;
+                    s2=fat_run(bpb,&clu,s);
+                    if(s2==0) goto diskerr;
+                    r=sd_readblock(part->start+(c-2)*bpb->spc+data_sec,ptr,(s2+511)/512);
+                    if(r==0) goto diskerr;
                     ptr+=s2;
                     s-=s2;
                 }
@@ -1176,22 +1774,51 @@ diskerr:
         }
         // walk through cluster chain to load initrd
         if(clu!=0 && initrd.size!=0) {
-            initrd.ptr=ptr=pe;
-            s=initrd.size;
-            while(s>0) {
-                s2=s>bpb->spc*512?bpb->spc*512:s;
-                r=sd_readblock(part->start+(clu-2)*bpb->spc+data_sec,ptr,s2<512?1:s2/512);
-                clu=bpb->spf16>0?fat16[clu]:fat32[clu];
-                ptr+=s2;
-                s-=s2;
-            }
+            // look at the first sector to see where it goes, unless it would
+            // overwrite the FAT table, then load it after the directory
+            r=sd_readblock(part->start+(clu-2)*bpb->spc+data_sec,pe,1);
+            if(r==0) goto diskerr;
+            ptr=initrd_dest(pe);
+            if(ptr+initrd.size+bpb->spc*512>FATBUF) ptr=pe;
+            initrd.ptr=ptr;
+            // read runs of consecutive clusters, each one is transferred while the
+            // previous one is used
+            fat_bpb=bpb; fat_data=part->start+data_sec;
+            fat_clu=clu; fat_left=initrd.size; fat_ptr=ptr;
+            if(!fat_readnext() || !fat_readwait()) goto diskerr;
+            // a gzip image is inflated while it's being read, unless it's seekable
+            if(ptr==INITRD_HIGH && ptr[0]==0x1F && ptr[1]==0x8B && gzix_index(ptr)==NULL)
+                gzlen=gzip_stream();
+            while(fat_readwait());
+            if(fat_left) goto diskerr;
         }
     } else {
-        // initrd is on the entire partition
-        r=sd_readblock(part->start,(unsigned char*)&_end+512,part->end-part->start);
+        // initrd is on the entire partition, only read the part its file system uses
+        uint64_t size=(part->end-part->start)*512, used, head, tail, have, n;
+        initrd.ptr=initrd_dest(FATBUF);
+        have=size<FS_HEADSIZE?size:FS_HEADSIZE;
+        r=sd_readblock(part->start,initrd.ptr,have/512);
         if(r==0) goto diskerr;
-        initrd.ptr=(uint8_t*)&_end;
-        initrd.size=r;
+        // keep reading until the file system can tell its size
+        while(have<size && (used=fs_used(initrd.ptr,have,&head,&tail))!=0 && used<=size && head>have) {
+            n=((head>2*have?head:2*have)+511)&~511;
+            if(n>size) n=size;
+            r=sd_readblock(part->start+have/512,initrd.ptr+have,(n-have)/512);
+            if(r==0) goto diskerr;
+            have=n;
+        }
+        used=fs_used(initrd.ptr,have,&head,&tail);
+        if(used==0 || used>size || head>have) {
+            used=size;
+            tail=have;
+        }
+        // whatever's between the head and the tail is not used
+        if(tail<have) tail=have;
+        if(used>tail) {
+            r=sd_readblock(part->start+tail/512,initrd.ptr+tail,(used-tail+511)/512);
+            if(r==0) goto diskerr;
+        }
+        initrd.size=used;
     }
 gotinitrd:
     if(initrd.ptr==NULL || initrd.size==0) {
@@ -1201,50 +1828,123 @@ gotinitrd:
 #if INITRD_DEBUG
     uart_puts("Initrd at ");uart_hex((uint64_t)initrd.ptr,4);uart_putc(' ');uart_hex(initrd.size,4);uart_putc('\n');
 #endif
-    // uncompress if it's compressed
-    if(initrd.ptr[0]==0x1F && initrd.ptr[1]==0x8B) {
-        unsigned char *addr,f;
+    // uncompress if it's compressed. Seekable gzip images are kept compressed,
+    // files are inflated when they are looked up
+    if(gzlen) {
+        DBG(" * Gzip compressed initrd, inflated while loading\n");
+        initrd.ptr=(uint8_t*)&_end;
+        initrd.size=gzlen;
+    } else if(gzix_index(initrd.ptr)!=NULL) {
+        DBG(" * Seekable gzip compressed initrd\n");
+    } else if(initrd.ptr[0]==0x1F && initrd.ptr[1]==0x8B) {
+        unsigned char *addr;
+        uint32_t crc, len;
         volatile TINF_DATA d;
         DBG(" * Gzip compressed initrd\n");
-        // skip gzip header
-        addr=initrd.ptr+2;
-        if(*addr++!=8) goto gzerr;
-        f=*addr++; addr+=6;
-        if(f&4) { r=*addr++; r+=(*addr++ << 8); addr+=r; }
-        if(f&8) { while(*addr++ != 0); }
-        if(f&16) { while(*addr++ != 0); }
-        if(f&2) addr+=2;
-        d.source = addr;
-        memcpy((void*)&d.destSize,initrd.ptr+initrd.size-4,4);
-        // decompress
-        d.bitcount = 0;
-        d.bfinal = 0;
-        d.btype = -1;
-        d.curlen = 0;
-        if((uint8_t*)&_end+d.destSize<addr)
-            d.dest=(uint8_t*)&_end;
+        // concatenated gzip members are inflated on all cores in parallel
+        if((len=gzip_parallel())!=0) {
+            initrd.size=len;
+        } else {
+            // skip gzip header
+            addr=gzip_data(initrd.ptr);
+            if(addr==NULL) goto gzerr;
+            d.source = addr;
+            d.source_limit = initrd.ptr+initrd.size;
+            memcpy((void*)&d.destSize,initrd.ptr+initrd.size-4,4);
+            memcpy((void*)&crc,initrd.ptr+initrd.size-8,4);
+            // decompress
+            uzlib_uncompress_init(&d, NULL, 0);
+            d.checksum_type = TINF_CHKSUM_CRC;
+            d.checksum = ~0;
+            if((uint8_t*)&_end+d.destSize<addr)
+                d.dest=(uint8_t*)&_end;
+            else
+                d.dest=(uint8_t*)((uint64_t)(initrd.ptr+initrd.size+PAGESIZE-1)&~(PAGESIZE-1));
+            initrd.ptr=(uint8_t*)d.dest;
+            initrd.size=d.destSize;
+#if INITRD_DEBUG
+            uart_puts("Inflating to ");uart_hex((uint64_t)d.dest,4);uart_putc(' ');uart_hex(d.destSize,4);uart_putc('\n');
+#endif
+            puts(" * Inflating image...\r");
+            r = uzlib_uncompress_buf(&d, d.dest, d.destSize);
+            puts("                     \r");
+            if (r != TINF_DONE) {
+gzerr:          puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+                goto error;
+            }
+            // verify the gzip trailer's crc32
+            if (~d.checksum != crc) {
+                puts("BOOTBOOT-PANIC: Initrd checksum mismatch\n");
+                goto error;
+            }
+        }
+    } else if(initrd.ptr[0]==0x04 && initrd.ptr[1]==0x22 && initrd.ptr[2]==0x4D && initrd.ptr[3]==0x18) {
+        unsigned char *addr;
+        uint32_t len;
+        DBG(" * LZ4 compressed initrd\n");
+        // get the uncompressed size, from the frame header if it's recorded
+        if(lz4_uncompress(initrd.ptr, initrd.size, NULL, &len) != LZ4_OK) {
+            puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+            goto error;
+        }
+        if((uint8_t*)&_end+len<initrd.ptr)
+            addr=(uint8_t*)&_end;
+        else
+            addr=(uint8_t*)((uint64_t)(initrd.ptr+initrd.size+PAGESIZE-1)&~(PAGESIZE-1));
+#if INITRD_DEBUG
+        uart_puts("Uncompressing to ");uart_hex((uint64_t)addr,4);uart_putc(' ');uart_hex(len,4);uart_putc('\n');
+#endif
+        puts(" * Uncompressing image...\r");
+        r = lz4_uncompress(initrd.ptr, initrd.size, addr, &len);
+        puts("                         \r");
+        if (r != LZ4_OK) {
+            puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+            goto error;
+        }
+        initrd.ptr=addr;
+        initrd.size=len;
+    } else if(initrd.ptr[0]==0x28 && initrd.ptr[1]==0xB5 && initrd.ptr[2]==0x2F && initrd.ptr[3]==0xFD) {
+        unsigned char *addr;
+        uint32_t len;
+        // the decoder's workspace goes to the free area after the compressed
+        // initrd, the window is the output buffer itself
+        ZSTD_WORK *work=(ZSTD_WORK*)((uint64_t)(initrd.ptr+initrd.size+PAGESIZE-1)&~(PAGESIZE-1));
+        DBG(" * Zstd compressed initrd\n");
+        // get the uncompressed size, from the frame header if it's recorded
+        if(zstd_uncompress(initrd.ptr, initrd.size, NULL, &len, work) != ZSTD_OK) {
+            puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+            goto error;
+        }
+        if((uint8_t*)&_end+len<initrd.ptr)
+            addr=(uint8_t*)&_end;
         else
-            d.dest=(uint8_t*)((uint64_t)(initrd.ptr+initrd.size+PAGESIZE-1)&~(PAGESIZE-1));
-        initrd.ptr=(uint8_t*)d.dest;
-        initrd.size=d.destSize;
+            addr=(uint8_t*)(((uint64_t)work+sizeof(ZSTD_WORK)+PAGESIZE-1)&~(PAGESIZE-1));
 #if INITRD_DEBUG
-        uart_puts("Inflating to ");uart_hex((uint64_t)d.dest,4);uart_putc(' ');uart_hex(d.destSize,4);uart_putc('\n');
+        uart_puts("Uncompressing to ");uart_hex((uint64_t)addr,4);uart_putc(' ');uart_hex(len,4);uart_putc('\n');
 #endif
-        puts(" * Inflating image...\r");
-        do { r = uzlib_uncompress(&d); } while (!r);
-        puts("                     \r");
-        if (r != TINF_DONE) {
-gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+        puts(" * Uncompressing image...\r");
+        r = zstd_uncompress(initrd.ptr, initrd.size, addr, &len, work);
+        puts("                         \r");
+        if (r == ZSTD_CHKSUM_ERROR) {
+            puts("BOOTBOOT-PANIC: Initrd checksum mismatch\n");
             goto error;
         }
+        if (r != ZSTD_OK) {
+            puts("BOOTBOOT-PANIC: Unable to uncompress\n");
+            goto error;
+        }
+        initrd.ptr=addr;
+        initrd.size=len;
     }
-    // copy the initrd to it's final position, making it properly aligned
+    // copy the initrd to it's final position if it wasn't loaded or uncompressed
+    // there, making it properly aligned
     if((uint64_t)initrd.ptr!=(uint64_t)&_end) {
         memcpy((void*)&_end, initrd.ptr, initrd.size);
     }
     bootboot->initrd_ptr=(uint64_t)&_end;
     // round up to page size
     bootboot->initrd_size=(initrd.size+PAGESIZE-1)&~(PAGESIZE-1);
+    bootboot->aarch64.gzidx_ptr=(uint64_t)gzix_index((unsigned char*)bootboot->initrd_ptr);
     DBG(" * Initrd loaded\n");
 #if INITRD_DEBUG
     // dump initrd in memory
@@ -1253,10 +1953,7 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
 
     // if no config, locate it in uncompressed initrd
     if(*((uint8_t*)&__environment)==0) {
-        r=0; env.ptr=NULL;
-        while(env.ptr==NULL && fsdrivers[r]!=NULL) {
-            env=(*fsdrivers[r++])((unsigned char*)bootboot->initrd_ptr,cfgname);
-        }
+        env=fs_locate((unsigned char*)bootboot->initrd_ptr,cfgname);
         if(env.ptr!=NULL)
             memcpy((void*)&__environment,(void*)(env.ptr),env.size<PAGESIZE?env.size:PAGESIZE-1);
     }
@@ -1266,35 +1963,38 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
 
     // locate sys/core
     entrypoint=0;
-    r=0; core.ptr=NULL;
-    while(core.ptr==NULL && fsdrivers[r]!=NULL) {
-        core=(*fsdrivers[r++])((unsigned char*)bootboot->initrd_ptr,kernelname);
-    }
+    core=fs_locate((unsigned char*)bootboot->initrd_ptr,kernelname);
     if(kne!=NULL)
         *kne='\n';
     // scan for the first executable
     if(core.ptr==NULL || core.size==0) {
         DBG(" * Autodetecting kernel\n");
         core.size=0;
-        r=bootboot->initrd_size;
-        core.ptr=(uint8_t*)bootboot->initrd_ptr;
-        while(r-->0) {
+        pe=(uint8_t*)bootboot->initrd_ptr+(bootboot->initrd_size>sizeof(Elf64_Ehdr)?
+            bootboot->initrd_size-sizeof(Elf64_Ehdr):0);
+        // only dereference the headers at aligned candidates, the MMU is off
+        for(core.ptr=(uint8_t*)bootboot->initrd_ptr;(core.ptr=next_executable(core.ptr,pe))<pe;core.ptr++) {
             Elf64_Ehdr *ehdr=(Elf64_Ehdr *)(core.ptr);
-            pe_hdr *pehdr=(pe_hdr*)(core.ptr + ((mz_hdr*)(core.ptr))->peaddr);
+            pe_hdr *pehdr;
             if((!memcmp(ehdr->e_ident,ELFMAG,SELFMAG)||!memcmp(ehdr->e_ident,"OS/Z",4))&&
                 ehdr->e_ident[EI_CLASS]==ELFCLASS64&&
                 ehdr->e_ident[EI_DATA]==ELFDATA2LSB&&
+                !((uint64_t)core.ptr&7)&&
                 ehdr->e_machine==EM_AARCH64&&
                 ehdr->e_phnum>0){
                     core.size=1;
                     break;
                 }
-            if(((mz_hdr*)(core.ptr))->magic==MZ_MAGIC && pehdr->magic == PE_MAGIC && 
-                pehdr->machine == IMAGE_FILE_MACHINE_ARM64 && pehdr->file_type == PE_OPT_MAGIC_PE32PLUS) {
+            if(core.ptr[0]=='M' && core.ptr[1]=='Z' && !((uint64_t)core.ptr&7) &&
+                ((mz_hdr*)(core.ptr))->peaddr<bootboot->initrd_size &&
+                core.ptr+((mz_hdr*)(core.ptr))->peaddr<pe && !(((mz_hdr*)(core.ptr))->peaddr&3)) {
+                pehdr=(pe_hdr*)(core.ptr + ((mz_hdr*)(core.ptr))->peaddr);
+                if(pehdr->magic == PE_MAGIC && pehdr->machine == IMAGE_FILE_MACHINE_ARM64 &&
+                    pehdr->file_type == PE_OPT_MAGIC_PE32PLUS) {
                     core.size=1;
                     break;
                 }
-            core.ptr++;
+            }
         }
     }
     if(core.ptr==NULL || core.size==0) {
@@ -1303,6 +2003,7 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
     } else {
         Elf64_Ehdr *ehdr=(Elf64_Ehdr *)(core.ptr);
         pe_hdr *pehdr=(pe_hdr*)(core.ptr + ((mz_hdr*)(core.ptr))->peaddr);
+        corefile=core.ptr;
         if((!memcmp(ehdr->e_ident,ELFMAG,SELFMAG)||!memcmp(ehdr->e_ident,"OS/Z",4))&&
             ehdr->e_ident[EI_CLASS]==ELFCLASS64&&
             ehdr->e_ident[EI_DATA]==ELFDATA2LSB&&
@@ -1310,6 +2011,14 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
             ehdr->e_phnum>0){
                 DBG(" * Parsing ELF64\n");
                 Elf64_Phdr *phdr=(Elf64_Phdr *)((uint8_t *)ehdr+ehdr->e_phoff);
+#ifdef _FS_Z_H_
+                // program headers of a fragmented file must be in its first sector
+                r=ehdr->e_phoff+ehdr->e_phnum*ehdr->e_phentsize-1;
+                if(fszfrag!=NULL && fsz_offset((unsigned char*)bootboot->initrd_ptr,fszfrag,r)!=core.ptr+r) {
+                    puts("BOOTBOOT-PANIC: Kernel is not a valid executable\n");
+                    goto error;
+                }
+#endif
                 for(r=0;r<ehdr->e_phnum;r++){
                     if(phdr->p_type==PT_LOAD && phdr->p_vaddr>>48==0xffff) {
                         core.ptr += phdr->p_offset;
@@ -1343,11 +2052,42 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
         puts("BOOTBOOT-PANIC: Kernel is not a valid executable\n");
         goto error;
     }
+    mp=(core.size+bss+PAGESIZE-1)/PAGESIZE;
+    if(mp>COREPAGES) {
+        puts("BOOTBOOT-PANIC: Kernel is too big\n");
+        goto error;
+    }
+    // page aligned data is mapped from the initrd in place, only the rest, the
+    // partial last page, holes in fragmented files and the bss are copied
+    // after the initrd
+    for(r=tailpages=0;r<mp;r++) {
+        coremap[r]=(uint64_t)(r+1)*PAGESIZE<=core.size?core_page(corefile,core.ptr-corefile+(uint64_t)r*PAGESIZE):NULL;
+        if(coremap[r]==NULL) tailpages++;
+    }
+    coretail=(uint8_t*)(bootboot->initrd_ptr+bootboot->initrd_size);
+    // pass the initrd's file index to the kernel. It's written after the core
+    // segment, or after the loader's own index if that ends later
+    r=fs_idxsize();
+    if(r>0) {
+        pe=(uint8_t*)&fsent[fsnum];
+        if(pe<coretail+tailpages*PAGESIZE)
+            pe=coretail+tailpages*PAGESIZE;
+        pe=(uint8_t*)(((uint64_t)pe+PAGESIZE-1)&~(PAGESIZE-1));
+        if((uint64_t)pe+r<MMIO_BASE) {
+            fs_export(pe);
+            bootboot->aarch64.fidx_ptr=(uint64_t)pe;
+        }
+    }
     // create core segment
-    memcpy((void*)(bootboot->initrd_ptr+bootboot->initrd_size), core.ptr, core.size);
-    core.ptr=(uint8_t*)(bootboot->initrd_ptr+bootboot->initrd_size);
-    if(bss>0)
-        memset(core.ptr + core.size, 0, bss);
+    memset(coretail, 0, tailpages*PAGESIZE);
+    for(r=np=0;r<mp;r++)
+        if(coremap[r]==NULL) {
+            coremap[r]=coretail+(uint64_t)(np++)*PAGESIZE;
+            if((uint64_t)r*PAGESIZE<core.size)
+                core_read(coremap[r],corefile,core.ptr-corefile+(uint64_t)r*PAGESIZE,
+                    core.size-(uint64_t)r*PAGESIZE<PAGESIZE?core.size-(uint64_t)r*PAGESIZE:PAGESIZE);
+        }
+    core.ptr=coremap[0];
     core.size = (core.size+bss+PAGESIZE-1)&~(PAGESIZE-1);
 #if EXEC_DEBUG
     uart_puts("Core ");
@@ -1355,6 +2095,9 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
     uart_puts(" to ");
     uart_hex((uint64_t)core.ptr+core.size,4);
     uart_putc('\n');
+    uart_puts("Mapped from initrd ");
+    uart_hex((uint64_t)(mp-tailpages),4);
+    uart_puts(" pages\n");
 #endif
 
     /* generate memory map to bootboot struct */
@@ -1369,7 +2112,10 @@ gzerr:      puts("BOOTBOOT-PANIC: Unable to uncompress\n");
     mmap->ptr=(uint64_t)&__bootboot; mmap->size=((uint64_t)&_end-(uint64_t)&__bootboot) | MMAP_USED;
     mmap++; bootboot->size+=sizeof(MMapEnt);
 
-    r=bootboot->initrd_size + core.size;
+    r=bootboot->initrd_size + tailpages*PAGESIZE;
+    // extend it to the end of the file table
+    if(bootboot->aarch64.fidx_ptr)
+        r=bootboot->aarch64.fidx_ptr+((INITRD_IDX*)bootboot->aarch64.fidx_ptr)->size-bootboot->initrd_ptr;
     // after bss and before initrd is free
     if(bootboot->initrd_ptr-(uint64_t)&_end) {
         mmap->ptr=(uint64_t)&_end; mmap->size=(bootboot->initrd_ptr-(uint64_t)&_end) | MMAP_FREE;
@@ -1465,7 +2211,7 @@ viderr:
     paging[5*512+0]=(uint64_t)((uint8_t*)&__bootboot)|0b11|(3<<8)|(1<<10)|(1L<<54);  // p, b, AF, ISH
     paging[5*512+1]=(uint64_t)((uint8_t*)&__environment)|0b11|(3<<8)|(1<<10)|(1L<<54);
     for(r=0;r<(core.size/PAGESIZE);r++)
-        paging[5*512+2+r]=(uint64_t)((uint8_t *)core.ptr+(uint64_t)r*PAGESIZE)|0b11|(3<<8)|(1<<10);
+        paging[5*512+2+r]=(uint64_t)coremap[r]|0b11|(3<<8)|(1<<10);
 #if MEM_DEBUG
     reg=r;
 #endif
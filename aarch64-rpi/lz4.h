@@ -0,0 +1,53 @@
+/*
+ * aarch64-rpi/lz4.h
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Tiny LZ4 frame decoder
+ *
+ */
+
+#ifndef LZ4_H_INCLUDED
+#define LZ4_H_INCLUDED
+
+#define LZ4_OK             0
+#define LZ4_DATA_ERROR    (-3)
+#define LZ4_CHKSUM_ERROR  (-4)
+
+/* first bytes of an LZ4 frame, 04 22 4D 18 */
+#define LZ4_MAGIC         0x184D2204
+
+/* Decompress concatenated LZ4 frames. If dst is NULL, only the uncompressed
+   size is returned in dstlen, otherwise dstlen is the size of dst on entry
+   and the number of bytes written on return */
+int lz4_uncompress(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen);
+
+/* Decompress a single raw block without frame, as SquashFS stores them.
+   dstlen is the size of dst on entry and the number of bytes written on return */
+int lz4_uncompress_block(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen);
+
+/* xxHash32 used by the frame checksums, seed is 0 for LZ4 */
+unsigned int lz4_xxh32(const void *data, unsigned int length, unsigned int seed);
+
+#endif /* LZ4_H_INCLUDED */
@@ -49,9 +49,14 @@ extern "C" {
 
 /* data structures */
 
+/* number of bits resolved by the first level of the lookup table */
+#define TINF_ROOT_BITS   9
+/* 512 root entries plus worst case second level tables for 288 symbols */
+#define TINF_TABLE_SIZE  1024
+
 typedef struct {
-   unsigned int table[16];  /* table of code length counts */
-   unsigned int trans[288]; /* code -> symbol translation table */
+   unsigned int table[16];   /* table of code length counts */
+   unsigned int fast[TINF_TABLE_SIZE]; /* bit-reversed code -> symbol lookup table */
 } TINF_TREE;
 
 struct TINF_DATA;
@@ -59,12 +64,17 @@ typedef struct TINF_DATA {
    TINF_TREE ltree; /* dynamic length/symbol tree */
    TINF_TREE dtree; /* dynamic distance tree */
    const unsigned char *source;
+   /* End of the source buffer, if set, bits are loaded a word at a time */
+   const unsigned char *source_limit;
    /* If source above is NULL, this function will be used to read
-      next byte from source stream */
+      next byte from source stream. If source_limit is also set, it is
+      called when source reaches it to switch to the next chunk */
    unsigned char (*readSource)(volatile struct TINF_DATA *data);
 
-   unsigned int tag;
+   uint64_t tag;
    unsigned int bitcount;
+   /* zero bytes supplied past source_limit without a readSource */
+   unsigned int overrun;
 
     /* Buffer start */
     unsigned char *destStart;
@@ -95,8 +105,9 @@ unsigned char TINFCC uzlib_get_byte(volatile TINF_DATA *d);
 /* Decompression API */
 
 void TINFCC uzlib_init(void);
-void TINFCC uzlib_uncompress_init(TINF_DATA *d, void *dict, unsigned int dictLen);
+void TINFCC uzlib_uncompress_init(volatile TINF_DATA *d, void *dict, unsigned int dictLen);
 int  TINFCC uzlib_uncompress(volatile TINF_DATA *d);
+int  TINFCC uzlib_uncompress_buf(volatile TINF_DATA *d, void *dst, unsigned int len);
 int  TINFCC uzlib_uncompress_chksum(TINF_DATA *d);
 
 int TINFCC uzlib_zlib_parse_header(TINF_DATA *d);
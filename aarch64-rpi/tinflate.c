@@ -111,36 +111,35 @@ static void tinf_build_bits_base(unsigned char *bits, unsigned short *base, int
 }
 #endif
 
-/* build the fixed huffman trees */
-static void tinf_build_fixed_trees(volatile TINF_TREE *lt, volatile TINF_TREE *dt)
+/* lookup table entries. If bit 15 is set, the entry points to a second level
+   table at bits 0-11, indexed by the next bits 12-14 number of bits. Otherwise
+   bits 9-12 hold the code length (0 for an unused code), bits 0-8 the symbol. */
+#define TINF_LINK           0x8000
+#define TINF_LINK_BITS(e)   (((e) >> 12) & 7)
+#define TINF_LINK_OFFS(e)   ((e) & 0xfff)
+#define TINF_SYM_LEN(e)     ((e) >> 9)
+#define TINF_SYM(e)         ((e) & 0x1ff)
+
+/* reverse the lowest len bits of a canonical code */
+static unsigned int tinf_bitrev(unsigned int code, unsigned int len)
 {
-   int i;
-
-   /* build fixed length tree */
-   for (i = 0; i < 7; ++i) lt->table[i] = 0;
-
-   lt->table[7] = 24;
-   lt->table[8] = 152;
-   lt->table[9] = 112;
+   unsigned int rev = 0;
 
-   for (i = 0; i < 24; ++i) lt->trans[i] = 256 + i;
-   for (i = 0; i < 144; ++i) lt->trans[24 + i] = i;
-   for (i = 0; i < 8; ++i) lt->trans[24 + 144 + i] = 280 + i;
-   for (i = 0; i < 112; ++i) lt->trans[24 + 144 + 8 + i] = 144 + i;
-
-   /* build fixed distance tree */
-   for (i = 0; i < 5; ++i) dt->table[i] = 0;
-
-   dt->table[5] = 32;
+   while (len--)
+   {
+      rev = (rev << 1) | (code & 1);
+      code >>= 1;
+   }
 
-   for (i = 0; i < 32; ++i) dt->trans[i] = i;
+   return rev;
 }
 
 /* given an array of code lengths, build a tree */
-static void tinf_build_tree(volatile TINF_TREE *t, const unsigned char *lengths, unsigned int num)
+static int tinf_build_tree(volatile TINF_TREE *t, const unsigned char *lengths, unsigned int num)
 {
-   unsigned short offs[16];
-   unsigned int i, sum;
+   unsigned short next[16], first[16];
+   unsigned int i, j, len, code, used;
+   int left;
 
    /* clear code length count table */
    for (i = 0; i < 16; ++i) t->table[i] = 0;
@@ -150,18 +149,87 @@ static void tinf_build_tree(volatile TINF_TREE *t, const unsigned char *lengths,
 
    t->table[0] = 0;
 
-   /* compute offset table for distribution sort */
-   for (sum = 0, i = 0; i < 16; ++i)
+   /* clear root table, unused codes decode as errors */
+   for (i = 0; i < (1 << TINF_ROOT_BITS); ++i) t->fast[i] = 0;
+
+   /* refuse over-subscribed code length sets */
+   for (left = 1, i = 1; i < 16; ++i)
+   {
+      left = (left << 1) - t->table[i];
+      if (left < 0) return TINF_DATA_ERROR;
+   }
+
+   /* compute first canonical code for each length */
+   for (code = 0, i = 1; i < 16; ++i)
+   {
+      code = (code + t->table[i - 1]) << 1;
+      first[i] = next[i] = code;
+   }
+
+   /* find the longest code behind every root prefix to size second level tables */
+   for (i = 0; i < num; ++i)
+   {
+      len = lengths[i];
+      if (len > TINF_ROOT_BITS)
+      {
+         j = tinf_bitrev(next[len]++, len) & ((1 << TINF_ROOT_BITS) - 1);
+         if (len - TINF_ROOT_BITS > t->fast[j]) t->fast[j] = len - TINF_ROOT_BITS;
+      }
+   }
+
+   /* allocate second level tables right after the root table */
+   for (used = 1 << TINF_ROOT_BITS, i = 0; i < (1 << TINF_ROOT_BITS); ++i)
    {
-      offs[i] = sum;
-      sum += t->table[i];
+      if (t->fast[i])
+      {
+         len = t->fast[i];
+         if (used + (1 << len) > TINF_TABLE_SIZE) return TINF_DATA_ERROR;
+         for (j = 0; j < (1u << len); ++j) t->fast[used + j] = 0;
+         t->fast[i] = TINF_LINK | (len << 12) | used;
+         used += 1 << len;
+      }
    }
 
-   /* create code->symbol translation table (symbols sorted by code) */
+   /* fill in symbols, replicating short codes over all the entries they prefix */
+   for (i = 0; i < 16; ++i) next[i] = first[i];
    for (i = 0; i < num; ++i)
    {
-      if (lengths[i]) t->trans[offs[lengths[i]]++] = i;
+      len = lengths[i];
+      if (!len) continue;
+      code = tinf_bitrev(next[len]++, len);
+      if (len <= TINF_ROOT_BITS)
+      {
+         for (j = code; j < (1 << TINF_ROOT_BITS); j += 1 << len)
+            t->fast[j] = (len << 9) | i;
+      } else {
+         unsigned int e = t->fast[code & ((1 << TINF_ROOT_BITS) - 1)];
+         len -= TINF_ROOT_BITS;
+         for (j = code >> TINF_ROOT_BITS; j < (1u << TINF_LINK_BITS(e)); j += 1 << len)
+            t->fast[TINF_LINK_OFFS(e) + j] = (len << 9) | i;
+      }
    }
+
+   return TINF_OK;
+}
+
+/* build the fixed huffman trees */
+static void tinf_build_fixed_trees(volatile TINF_TREE *lt, volatile TINF_TREE *dt)
+{
+   unsigned char lengths[288];
+   int i;
+
+   /* build fixed length tree */
+   for (i = 0; i < 144; ++i) lengths[i] = 8;
+   for (; i < 256; ++i) lengths[i] = 9;
+   for (; i < 280; ++i) lengths[i] = 7;
+   for (; i < 288; ++i) lengths[i] = 8;
+
+   tinf_build_tree(lt, lengths, 288);
+
+   /* build fixed distance tree */
+   for (i = 0; i < 32; ++i) lengths[i] = 5;
+
+   tinf_build_tree(dt, lengths, 32);
 }
 
 /* ---------------------- *
@@ -170,10 +238,30 @@ static void tinf_build_tree(volatile TINF_TREE *t, const unsigned char *lengths,
 
 unsigned char uzlib_get_byte(volatile TINF_DATA *d)
 {
-    if (d->source) {
+    if (d->source && (!d->source_limit || d->source < d->source_limit)) {
         return *d->source++;
     }
-    return d->readSource(d);
+    /* with a chunked source, readSource switches to the next chunk */
+    if (d->readSource) return d->readSource(d);
+    /* past the end of the input, feed zeros and let the caller notice */
+    d->overrun++;
+    return 0;
+}
+
+/* read a whole byte, taking already buffered bits first */
+static unsigned int tinf_get_byte(volatile TINF_DATA *d)
+{
+   unsigned int c;
+
+   if (d->bitcount >= 8)
+   {
+      c = d->tag & 0xff;
+      d->tag >>= 8;
+      d->bitcount -= 8;
+      return c;
+   }
+
+   return uzlib_get_byte(d);
 }
 
 uint32_t tinf_get_le_uint32(TINF_DATA *d)
@@ -181,7 +269,7 @@ uint32_t tinf_get_le_uint32(TINF_DATA *d)
     uint32_t val = 0;
     int i;
     for (i = 4; i--;) {
-        val = val >> 8 | uzlib_get_byte(d) << 24;
+        val = val >> 8 | tinf_get_byte(d) << 24;
     }
     return val;
 }
@@ -191,27 +279,49 @@ uint32_t tinf_get_be_uint32(TINF_DATA *d)
     uint32_t val = 0;
     int i;
     for (i = 4; i--;) {
-        val = val << 8 | uzlib_get_byte(d);
+        val = val << 8 | tinf_get_byte(d);
     }
     return val;
 }
 
+/* make sure there are at least num bits in the tag */
+static void tinf_refill(volatile TINF_DATA *d, unsigned int num)
+{
+   while (d->bitcount < num)
+   {
+      /* unaligned access faults with the MMU off, so load the aligned
+         word holding the next byte and use as many bytes of it as fit */
+      if (d->source && d->source_limit &&
+          (const unsigned char*)((uint64_t)d->source & ~7) + 8 <= d->source_limit)
+      {
+         unsigned int offs = (uint64_t)d->source & 7, n = (63 - d->bitcount) >> 3;
+         uint64_t val = *((volatile uint64_t*)((uint64_t)d->source & ~7)) >> (offs << 3);
+         if (n > 8 - offs) n = 8 - offs;
+         d->tag |= val << d->bitcount;
+         d->source += n;
+         d->bitcount += n << 3;
+         /* keep the bits above bitcount clear */
+         d->tag &= ((uint64_t)1 << d->bitcount) - 1;
+         continue;
+      }
+      /* streaming source, one byte at a time */
+      d->tag |= (uint64_t)uzlib_get_byte(d) << d->bitcount;
+      d->bitcount += 8;
+   }
+}
+
 /* get one bit from source stream */
 static int tinf_getbit(volatile TINF_DATA *d)
 {
    unsigned int bit;
 
    /* check if tag is empty */
-   if (!d->bitcount--)
-   {
-      /* load next tag */
-      d->tag = uzlib_get_byte(d);
-      d->bitcount = 7;
-   }
+   tinf_refill(d, 1);
 
    /* shift bit out of tag */
    bit = d->tag & 0x01;
    d->tag >>= 1;
+   d->bitcount--;
 
    return bit;
 }
@@ -219,43 +329,56 @@ static int tinf_getbit(volatile TINF_DATA *d)
 /* read a num bit value from a stream and add base */
 static unsigned int tinf_read_bits(volatile TINF_DATA *d, int num, int base)
 {
-   unsigned int val = 0;
+   unsigned int val;
 
-   /* read num bits */
-   if (num)
-   {
-      unsigned int limit = 1 << (num);
-      unsigned int mask;
+   if (!num) return base;
 
-      for (mask = 1; mask < limit; mask *= 2)
-         if (tinf_getbit(d)) val += mask;
-   }
+   /* peek num bits and consume them */
+   tinf_refill(d, num);
+   val = d->tag & ((1 << num) - 1);
+   d->tag >>= num;
+   d->bitcount -= num;
 
    return val + base;
 }
 
-/* given a data stream and a tree, decode a symbol */
-static int tinf_decode_symbol(volatile TINF_DATA *d, volatile TINF_TREE *t)
+/* look up the next symbol without consuming it, returns the symbol and the
+   full length of its code as a table entry, or zero for an invalid code */
+static unsigned int tinf_lookup_symbol(volatile TINF_DATA *d, volatile TINF_TREE *t)
 {
-   int sum = 0, cur = 0, len = 0;
+   unsigned int e;
 
-   /* get more bits while code value is above sum */
-   do {
+   /* look up the first TINF_ROOT_BITS bits of the code */
+   tinf_refill(d, TINF_ROOT_BITS);
+   e = t->fast[d->tag & ((1 << TINF_ROOT_BITS) - 1)];
 
-      cur = 2*cur + tinf_getbit(d);
+   /* longer codes continue in a second level table */
+   if (e & TINF_LINK)
+   {
+      tinf_refill(d, TINF_ROOT_BITS + TINF_LINK_BITS(e));
+      e = t->fast[TINF_LINK_OFFS(e) +
+         ((d->tag >> TINF_ROOT_BITS) & ((1 << TINF_LINK_BITS(e)) - 1))];
+      if (e) e += TINF_ROOT_BITS << 9;
+   }
 
-      ++len;
+   return e;
+}
 
-      sum += t->table[len];
-      cur -= t->table[len];
+/* given a data stream and a tree, decode a symbol */
+static int tinf_decode_symbol(volatile TINF_DATA *d, volatile TINF_TREE *t)
+{
+   unsigned int e = tinf_lookup_symbol(d, t);
 
-   } while (cur >= 0);
+   if (!TINF_SYM_LEN(e)) return TINF_DATA_ERROR;
 
-   return t->trans[sum + cur];
+   d->tag >>= TINF_SYM_LEN(e);
+   d->bitcount -= TINF_SYM_LEN(e);
+
+   return TINF_SYM(e);
 }
 
 /* given a data stream, decode dynamic trees from it */
-static void tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, volatile TINF_TREE *dt)
+static int tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, volatile TINF_TREE *dt)
 {
    unsigned char lengths[288+32];
    unsigned int hlit, hdist, hclen;
@@ -282,7 +405,7 @@ static void tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, vol
    }
 
    /* build code length tree, temporarily use length tree */
-   tinf_build_tree(lt, lengths, 19);
+   if (tinf_build_tree(lt, lengths, 19) != TINF_OK) return TINF_DATA_ERROR;
 
    /* decode code lengths for the dynamic trees */
    for (num = 0; num < hlit + hdist; )
@@ -294,8 +417,12 @@ static void tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, vol
       case 16:
          /* copy previous code length 3-6 times (read 2 bits) */
          {
-            unsigned char prev = lengths[num - 1];
-            for (length = tinf_read_bits(d, 2, 3); length; --length)
+            unsigned char prev;
+            if (num == 0) return TINF_DATA_ERROR;
+            prev = lengths[num - 1];
+            length = tinf_read_bits(d, 2, 3);
+            if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+            for (; length; --length)
             {
                lengths[num++] = prev;
             }
@@ -303,19 +430,24 @@ static void tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, vol
          break;
       case 17:
          /* repeat code length 0 for 3-10 times (read 3 bits) */
-         for (length = tinf_read_bits(d, 3, 3); length; --length)
+         length = tinf_read_bits(d, 3, 3);
+         if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+         for (; length; --length)
          {
             lengths[num++] = 0;
          }
          break;
       case 18:
          /* repeat code length 0 for 11-138 times (read 7 bits) */
-         for (length = tinf_read_bits(d, 7, 11); length; --length)
+         length = tinf_read_bits(d, 7, 11);
+         if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+         for (; length; --length)
          {
             lengths[num++] = 0;
          }
          break;
       default:
+         if (sym < 0) return TINF_DATA_ERROR;
          /* values 0-15 represent the actual code lengths */
          lengths[num++] = sym;
          break;
@@ -323,8 +455,11 @@ static void tinf_decode_trees(volatile TINF_DATA *d, volatile TINF_TREE *lt, vol
    }
 
    /* build dynamic trees */
-   tinf_build_tree(lt, lengths, hlit);
-   tinf_build_tree(dt, lengths + hlit, hdist);
+   if (tinf_build_tree(lt, lengths, hlit) != TINF_OK ||
+       tinf_build_tree(dt, lengths + hlit, hdist) != TINF_OK)
+      return TINF_DATA_ERROR;
+
+   return TINF_OK;
 }
 
 /* ----------------------------- *
@@ -340,6 +475,8 @@ static int tinf_inflate_block_data(volatile TINF_DATA *d, volatile TINF_TREE *lt
         int sym = tinf_decode_symbol(d, lt);
         //printf("huff sym: %02x\n", sym);
 
+        if (sym < 0) return TINF_DATA_ERROR;
+
         /* literal byte */
         if (sym < 256) {
             TINF_PUT(d, sym);
@@ -353,10 +490,12 @@ static int tinf_inflate_block_data(volatile TINF_DATA *d, volatile TINF_TREE *lt
 
         /* substring from sliding dictionary */
         sym -= 257;
+        if (sym >= 29) return TINF_DATA_ERROR;
         /* possibly get more bits from length code */
         d->curlen = tinf_read_bits(d, length_bits[sym], length_base[sym]);
 
         dist = tinf_decode_symbol(d, dt);
+        if (dist < 0 || dist >= 30) return TINF_DATA_ERROR;
         /* possibly get more bits from distance code */
         offs = tinf_read_bits(d, dist_bits[dist], dist_base[dist]);
         d->lzOff = -offs;
@@ -375,30 +514,200 @@ static int tinf_inflate_uncompressed_block(volatile TINF_DATA *d)
     if (d->curlen == 0) {
         unsigned int length, invlength;
 
+        /* make sure we start next block on a byte boundary */
+        d->tag >>= d->bitcount & 7;
+        d->bitcount &= ~7;
+
         /* get length */
-        length = uzlib_get_byte(d) + 256 * uzlib_get_byte(d);
+        length = tinf_get_byte(d);
+        length |= tinf_get_byte(d) << 8;
         /* get one's complement of length */
-        invlength = uzlib_get_byte(d) + 256 * uzlib_get_byte(d);
+        invlength = tinf_get_byte(d);
+        invlength |= tinf_get_byte(d) << 8;
         /* check length */
         if (length != (~invlength & 0x0000ffff)) return TINF_DATA_ERROR;
 
         /* increment length to properly return TINF_DONE below, without
            producing data at the same time */
         d->curlen = length + 1;
-
-        /* make sure we start next block on a byte boundary */
-        d->bitcount = 0;
     }
 
     if (--d->curlen == 0) {
         return TINF_DONE;
     }
 
-    unsigned char c = uzlib_get_byte(d);
+    unsigned char c = tinf_get_byte(d);
     TINF_PUT(d, c);
     return TINF_OK;
 }
 
+/* copy len bytes forward, source and destination may overlap. Unaligned
+   access faults with the MMU off, so this is done byte by byte */
+static void tinf_copy(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+   while (len--) *dst++ = *src++;
+}
+
+/* given a stream and two trees, inflate a block of data until the block
+   ends or the output reaches end */
+static int tinf_inflate_block_buf(volatile TINF_DATA *d, volatile TINF_TREE *lt, volatile TINF_TREE *dt, unsigned char *end)
+{
+    unsigned char *dest = d->dest;
+
+    for (;;) {
+        unsigned int offs, n;
+        int sym, dist;
+
+        /* finish the pending substring */
+        if (d->curlen) {
+            n = d->curlen < (unsigned int)(end - dest) ? d->curlen : (unsigned int)(end - dest);
+            tinf_copy(dest, dest + d->lzOff, n);
+            dest += n;
+            d->curlen -= n;
+            if (d->curlen) break;
+        }
+
+        /* output is full, only the end of block may follow */
+        if (dest == end) {
+            unsigned int e = tinf_lookup_symbol(d, lt);
+            if (TINF_SYM(e) != 256 || !TINF_SYM_LEN(e)) break;
+            d->tag >>= TINF_SYM_LEN(e);
+            d->bitcount -= TINF_SYM_LEN(e);
+            d->dest = dest;
+            return TINF_DONE;
+        }
+
+        sym = tinf_decode_symbol(d, lt);
+
+        /* literal byte */
+        if ((unsigned int)sym < 256) {
+            *dest++ = sym;
+            continue;
+        }
+
+        /* end of block */
+        if (sym == 256) {
+            d->dest = dest;
+            return TINF_DONE;
+        }
+
+        /* substring from sliding dictionary */
+        sym -= 257;
+        if (sym < 0 || sym >= 29) return TINF_DATA_ERROR;
+        /* possibly get more bits from length code */
+        d->curlen = tinf_read_bits(d, length_bits[sym], length_base[sym]);
+
+        dist = tinf_decode_symbol(d, dt);
+        if (dist < 0 || dist >= 30) return TINF_DATA_ERROR;
+        /* possibly get more bits from distance code */
+        offs = tinf_read_bits(d, dist_bits[dist], dist_base[dist]);
+        /* must not reach back before the start of output */
+        if (offs > (unsigned int)(dest - d->destStart)) return TINF_DATA_ERROR;
+        d->lzOff = -offs;
+    }
+
+    d->dest = dest;
+    return TINF_OK;
+}
+
+/* copy an uncompressed block until the block ends or the output reaches end */
+static int tinf_inflate_uncompressed_buf(volatile TINF_DATA *d, unsigned char *end)
+{
+    unsigned int n;
+
+    if (d->curlen == 0) {
+        unsigned int length, invlength;
+
+        /* make sure we start next block on a byte boundary */
+        d->tag >>= d->bitcount & 7;
+        d->bitcount &= ~7;
+
+        /* get length */
+        length = tinf_get_byte(d);
+        length |= tinf_get_byte(d) << 8;
+        /* get one's complement of length */
+        invlength = tinf_get_byte(d);
+        invlength |= tinf_get_byte(d) << 8;
+        /* check length */
+        if (length != (~invlength & 0x0000ffff)) return TINF_DATA_ERROR;
+
+        /* one more than the remaining bytes, zero means no header read yet */
+        d->curlen = length + 1;
+    }
+
+    /* bytes still buffered in the tag come first */
+    while (d->curlen > 1 && d->dest < end && d->bitcount >= 8) {
+        *d->dest++ = tinf_get_byte(d);
+        d->curlen--;
+    }
+
+    n = d->curlen - 1 < (unsigned int)(end - d->dest) ? d->curlen - 1 : (unsigned int)(end - d->dest);
+    d->curlen -= n;
+    while (n) {
+        /* copy as much as the source buffer (or its current chunk) has */
+        unsigned int m = n;
+        if (d->source && d->source_limit &&
+            (unsigned int)(d->source_limit - d->source) < m)
+            m = d->source_limit - d->source;
+        /* LEN is larger than what's left of the input */
+        if (!m && !d->readSource) return TINF_DATA_ERROR;
+        if (d->source && m) {
+            tinf_copy(d->dest, d->source, m);
+            d->source += m;
+            d->dest += m;
+            n -= m;
+        } else {
+            *d->dest++ = uzlib_get_byte(d);
+            n--;
+        }
+    }
+
+    if (d->curlen == 1) {
+        d->curlen = 0;
+        return TINF_DONE;
+    }
+    return TINF_OK;
+}
+
+/* ------------------------ *
+ * -- checksum functions -- *
+ * ------------------------ */
+
+/* crc32 of a nibble, reflected polynomial 0xedb88320 */
+static const unsigned int tinf_crc32tab[16] = {
+   0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190,
+   0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344,
+   0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278,
+   0xbdbdf21c
+};
+
+/* crc is previous value for incremental computation, 0xffffffff initially */
+uint32_t uzlib_crc32(const void *data, unsigned int length, uint32_t crc)
+{
+   const unsigned char *buf = (const unsigned char *)data;
+   unsigned int i;
+
+#ifdef __aarch64__
+   /* use the ARMv8 crc32 instructions. Unaligned access faults with the MMU
+      off, so go bytewise up to the first 8 byte boundary */
+   for (; length && ((uint64_t)buf & 7); --length)
+      __asm__ __volatile__ (".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*buf++));
+   for (; length >= 8; length -= 8, buf += 8)
+      __asm__ __volatile__ (".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(*(const uint64_t*)buf));
+   for (; length; --length)
+      __asm__ __volatile__ (".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"((uint32_t)*buf++));
+#endif
+
+   for (i = 0; i < length; ++i)
+   {
+      crc ^= buf[i];
+      crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
+      crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
+   }
+
+   return crc;
+}
+
 /* ---------------------- *
  * -- public functions -- *
  * ---------------------- */
@@ -438,7 +747,8 @@ next_blk:
                 tinf_build_fixed_trees(&d->ltree, &d->dtree);
             } else if (d->btype == 2) {
                 /* decode trees from stream */
-                tinf_decode_trees(d, &d->ltree, &d->dtree);
+                if (tinf_decode_trees(d, &d->ltree, &d->dtree) != TINF_OK)
+                    return TINF_DATA_ERROR;
             }
         }
 
@@ -459,6 +769,10 @@ next_blk:
             return TINF_DATA_ERROR;
         }
 
+        /* the bit reader may look ahead past the end, but consuming those
+           bits means the stream is truncated */
+        if (d->bitcount < d->overrun * 8) return TINF_DATA_ERROR;
+
         if (res == TINF_DONE && !d->bfinal) {
             /* the block has ended (without producing more data), but we
                can't return without data, so start procesing next block */
@@ -473,3 +787,80 @@ next_blk:
 
     return TINF_OK;
 }
+
+/* inflate into dst until len bytes are produced or the final block ends.
+   Returns TINF_DONE at the end of the stream, TINF_OK if the output got full
+   first (call again with the continuation of the same buffer) or an error.
+   The output buffer itself is the dictionary, dict_ring is not updated. With
+   checksum_type TINF_CHKSUM_CRC the crc32 of the output is accumulated in
+   checksum (start with 0xffffffff, the final crc is its complement) */
+int uzlib_uncompress_buf(volatile TINF_DATA *d, void *dst, unsigned int len)
+{
+    unsigned char *end = (unsigned char*)dst + len, *crcstart;
+    int res;
+
+    if (!d->destStart) d->destStart = dst;
+    d->dest = dst;
+
+    for (;;) {
+        /* start a new block */
+        if (d->btype == -1) {
+            if (d->bfinal) return TINF_DONE;
+            /* read final block flag */
+            d->bfinal = tinf_getbit(d);
+            /* read block type (2 bits) */
+            d->btype = tinf_read_bits(d, 2, 0);
+
+            if (d->btype == 1) {
+                /* build fixed huffman trees */
+                tinf_build_fixed_trees(&d->ltree, &d->dtree);
+            } else if (d->btype == 2) {
+                /* decode trees from stream */
+                if (tinf_decode_trees(d, &d->ltree, &d->dtree) != TINF_OK)
+                    return TINF_DATA_ERROR;
+            }
+        }
+
+        /* process current block */
+        crcstart = d->dest;
+        switch (d->btype)
+        {
+        case 0:
+            res = tinf_inflate_uncompressed_buf(d, end);
+            break;
+        case 1:
+        case 2:
+            res = tinf_inflate_block_buf(d, &d->ltree, &d->dtree, end);
+            break;
+        default:
+            return TINF_DATA_ERROR;
+        }
+
+        if (d->bitcount < d->overrun * 8) return TINF_DATA_ERROR;
+
+        /* checksum the output while it is still in the cache */
+        if (d->checksum_type == TINF_CHKSUM_CRC)
+            d->checksum = uzlib_crc32(crcstart, d->dest - crcstart, d->checksum);
+
+        if (res != TINF_DONE) {
+            return res;
+        }
+        d->btype = -1;
+    }
+}
+
+/* initialize decompression state */
+void uzlib_uncompress_init(volatile TINF_DATA *d, void *dict, unsigned int dictLen)
+{
+   d->tag = 0;
+   d->bitcount = 0;
+   d->bfinal = 0;
+   d->btype = -1;
+   d->curlen = 0;
+   d->destStart = 0;
+   d->checksum_type = TINF_CHKSUM_NONE;
+   d->readSource = 0;
+   d->overrun = 0;
+   (void)dict;
+   (void)dictLen;
+}
@@ -0,0 +1,742 @@
+/*
+ * aarch64-rpi/zstd.c
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Tiny allocation-free Zstandard decoder
+ *
+ */
+
+#include "zstd.h"
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3  1609587929392839161ULL
+#define XXH_PRIME4  9650029242287828579ULL
+#define XXH_PRIME5  2870177450012600261ULL
+
+/* frame header descriptor flags */
+#define ZSTD_FHD_SINGLE    0x20
+#define ZSTD_FHD_RESERVED  0x08
+#define ZSTD_FHD_CHKSUM    0x04
+
+/* highest accuracy logs and symbols of the sequence codes */
+#define ZSTD_LL_MAXAL      9
+#define ZSTD_OF_MAXAL      8
+#define ZSTD_ML_MAXAL      9
+#define ZSTD_LL_MAXSYM     35
+#define ZSTD_OF_MAXSYM     31
+#define ZSTD_ML_MAXSYM     52
+#define ZSTD_FSE_MAXSYM    52
+
+/* backward bit stream, bits are read from the end towards the start */
+typedef struct {
+    unsigned long bits;
+    unsigned int consumed;
+    const unsigned char *ptr, *start;
+} zstd_bits_t;
+
+/* state of the frame being decoded */
+typedef struct {
+    ZSTD_WORK *w;
+    unsigned char *dst;
+    unsigned int pos, start, size;
+} zstd_frame_t;
+
+/* -------------------------------------------------- *
+ * -- code tables (see RFC 8878 for their origin) -- *
+ * -------------------------------------------------- */
+
+static const unsigned int zstd_ll_base[ZSTD_LL_MAXSYM + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 18, 20, 22, 24, 28, 32, 40,
+    48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536 };
+static const unsigned char zstd_ll_bits[ZSTD_LL_MAXSYM + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3,
+    4, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+static const unsigned int zstd_ml_base[ZSTD_ML_MAXSYM + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26,
+    27, 28, 29, 30, 31, 32, 33, 34, 35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131,
+    259, 515, 1027, 2051, 4099, 8195, 16387, 32771, 65539 };
+static const unsigned char zstd_ml_bits[ZSTD_ML_MAXSYM + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7,
+    8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+/* predefined distributions */
+static const short zstd_ll_default[ZSTD_LL_MAXSYM + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1 };
+static const short zstd_of_default[ZSTD_OF_MAXSYM + 1] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1, -1, 0, 0, 0 };
+static const short zstd_ml_default[ZSTD_ML_MAXSYM + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1 };
+
+/* ----------------------- *
+ * -- utility functions -- *
+ * ----------------------- */
+
+/* read little endian values byte by byte, unaligned access faults with the
+   MMU off (volatile so that gcc won't merge the loads) */
+static unsigned int zstd_le16(const volatile unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int zstd_le24(const volatile unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static unsigned int zstd_le32(const volatile unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long zstd_le64(const volatile unsigned char *p)
+{
+    return zstd_le32(p) | ((unsigned long)zstd_le32(p + 4) << 32);
+}
+
+static unsigned int zstd_highbit(unsigned int v)
+{
+    return 31 - __builtin_clz(v);
+}
+
+static unsigned long zstd_rotl(unsigned long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long zstd_round(unsigned long acc, unsigned long v)
+{
+    return zstd_rotl(acc + v * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+unsigned long zstd_xxh64(const void *data, unsigned int length, unsigned long seed)
+{
+    const unsigned char *p = data, *end = p + length;
+    unsigned long h, v1, v2, v3, v4;
+
+    if (length >= 32) {
+        v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        v2 = seed + XXH_PRIME2;
+        v3 = seed;
+        v4 = seed - XXH_PRIME1;
+        do {
+            v1 = zstd_round(v1, zstd_le64(p));
+            v2 = zstd_round(v2, zstd_le64(p + 8));
+            v3 = zstd_round(v3, zstd_le64(p + 16));
+            v4 = zstd_round(v4, zstd_le64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = zstd_rotl(v1, 1) + zstd_rotl(v2, 7) + zstd_rotl(v3, 12) + zstd_rotl(v4, 18);
+        h = (h ^ zstd_round(0, v1)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ zstd_round(0, v2)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ zstd_round(0, v3)) * XXH_PRIME1 + XXH_PRIME4;
+        h = (h ^ zstd_round(0, v4)) * XXH_PRIME1 + XXH_PRIME4;
+    } else
+        h = seed + XXH_PRIME5;
+    h += length;
+    for (; end - p >= 8; p += 8)
+        h = zstd_rotl(h ^ zstd_round(0, zstd_le64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (end - p >= 4) {
+        h = zstd_rotl(h ^ (zstd_le32(p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while (p < end)
+        h = zstd_rotl(h ^ (*p++ * XXH_PRIME5), 11) * XXH_PRIME1;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* copy len bytes forward, source and destination may overlap */
+static void zstd_copy(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+    while (len--) *dst++ = *src++;
+}
+
+static void zstd_fill(unsigned char *dst, unsigned char c, unsigned int len)
+{
+    while (len--) *dst++ = c;
+}
+
+/* -------------------------- *
+ * -- bit stream functions -- *
+ * -------------------------- */
+
+/* start a backward bit stream, skipping the padding of its last byte */
+static int zstd_bits_init(zstd_bits_t *b, const unsigned char *src, unsigned int len)
+{
+    unsigned int i;
+
+    if (!len || !src[len - 1]) return ZSTD_DATA_ERROR;
+    b->start = src;
+    b->consumed = 8 - zstd_highbit(src[len - 1]);
+    if (len >= 8) {
+        b->ptr = src + len - 8;
+        b->bits = zstd_le64(b->ptr);
+    } else {
+        b->ptr = src;
+        for (b->bits = 0, i = 0; i < len; i++)
+            b->bits |= (unsigned long)src[i] << (i * 8);
+        b->consumed += (8 - len) * 8;
+    }
+    return ZSTD_OK;
+}
+
+/* peek num bits. Reading past the start of a corrupted stream returns
+   garbage, which is detected by the caller checking consumed at the end */
+static inline unsigned int zstd_bits_look(const zstd_bits_t *b, unsigned int num)
+{
+    return ((b->bits << (b->consumed & 63)) >> 1) >> ((63 - num) & 63);
+}
+
+static inline unsigned int zstd_bits_read(zstd_bits_t *b, unsigned int num)
+{
+    unsigned int v = zstd_bits_look(b, num);
+    b->consumed += num;
+    return v;
+}
+
+/* step back the whole bytes consumed, so that at least 56 bits are
+   available again (unless the start is reached) */
+static inline void zstd_bits_reload(zstd_bits_t *b)
+{
+    unsigned int n = b->consumed >> 3;
+
+    if (b->ptr - b->start >= 8) {
+        b->ptr -= n;
+        b->consumed &= 7;
+        b->bits = zstd_le64(b->ptr);
+        return;
+    }
+    if (b->consumed > 64) return;
+    if (n > (unsigned int)(b->ptr - b->start)) n = b->ptr - b->start;
+    if (!n) return;
+    b->ptr -= n;
+    b->consumed -= n << 3;
+    b->bits = zstd_le64(b->ptr);
+}
+
+/* true if exactly all bits of the stream were consumed */
+static int zstd_bits_end(const zstd_bits_t *b)
+{
+    return b->ptr == b->start && b->consumed == 64;
+}
+
+/* get 32 bits of a forward bit stream at bit pos, bits past the end are zeros */
+static unsigned int zstd_fwd(const unsigned char *src, unsigned int len, unsigned int pos)
+{
+    unsigned long v = 0;
+    unsigned int i, o = pos >> 3;
+
+    for (i = 0; i < 5 && o + i < len; i++)
+        v |= (unsigned long)src[o + i] << (i * 8);
+    return v >> (pos & 7);
+}
+
+/* ------------------- *
+ * -- FSE functions -- *
+ * ------------------- */
+
+/* read the normalized probabilities of a compressed FSE table description */
+static int zstd_fse_header(const unsigned char *src, unsigned int len, short *norm, unsigned int maxsym,
+    unsigned int maxal, unsigned int *al, unsigned int *used)
+{
+    unsigned int pos = 4, nbits, remaining, threshold, max, sym = 0, rep, v;
+    int count;
+
+    *al = (zstd_fwd(src, len, 0) & 15) + 5;
+    if (*al > maxal) return ZSTD_DATA_ERROR;
+    threshold = 1 << *al;
+    remaining = threshold + 1;
+    nbits = *al + 1;
+    while (remaining > 1) {
+        if (sym > maxsym) return ZSTD_DATA_ERROR;
+        v = zstd_fwd(src, len, pos);
+        max = 2 * threshold - 1 - remaining;
+        if ((v & (threshold - 1)) < max) {
+            count = v & (threshold - 1);
+            pos += nbits - 1;
+        } else {
+            count = v & (2 * threshold - 1);
+            if (count >= (int)threshold) count -= max;
+            pos += nbits;
+        }
+        /* -1 means less than 1, but it takes a slot too */
+        count--;
+        if ((unsigned int)(count < 0 ? -count : count) >= remaining) return ZSTD_DATA_ERROR;
+        remaining -= count < 0 ? -count : count;
+        norm[sym++] = count;
+        if (!count) {
+            /* 2 bit repeat flags for zero probabilities */
+            do {
+                v = rep = zstd_fwd(src, len, pos) & 3;
+                pos += 2;
+                if (sym + rep > maxsym + 1) return ZSTD_DATA_ERROR;
+                while (rep--) norm[sym++] = 0;
+            } while (v == 3);
+        }
+        while (remaining < threshold) {
+            nbits--;
+            threshold >>= 1;
+        }
+    }
+    while (sym <= maxsym) norm[sym++] = 0;
+    *used = (pos + 7) >> 3;
+    return *used > len ? ZSTD_DATA_ERROR : ZSTD_OK;
+}
+
+/* build the decoding table of a distribution with al accuracy log */
+static int zstd_fse_build(ZSTD_FSE *t, const short *norm, unsigned int maxsym, unsigned int al)
+{
+    unsigned short next[ZSTD_FSE_MAXSYM + 1];
+    unsigned int size = 1 << al, high = size - 1, step = (size >> 1) + (size >> 3) + 3, pos = 0, s, n;
+    int i;
+
+    /* less than 1 probabilities go to the end of the table */
+    for (s = 0; s <= maxsym; s++) {
+        if (norm[s] == -1) {
+            t[high--].symbol = s;
+            next[s] = 1;
+        } else
+            next[s] = norm[s];
+    }
+    /* spread the rest */
+    for (s = 0; s <= maxsym; s++)
+        for (i = 0; i < norm[s]; i++) {
+            t[pos].symbol = s;
+            do pos = (pos + step) & (size - 1); while (pos > high);
+        }
+    if (pos) return ZSTD_DATA_ERROR;
+    for (pos = 0; pos < size; pos++) {
+        n = next[t[pos].symbol]++;
+        t[pos].nbits = al - zstd_highbit(n);
+        t[pos].state = (n << t[pos].nbits) - size;
+    }
+    return ZSTD_OK;
+}
+
+/* set up the table of a sequence code by its compression mode, returns the
+   number of bytes used in used */
+static int zstd_fse_table(ZSTD_FSE *t, int *al, unsigned int mode, const unsigned char *src, unsigned int len,
+    unsigned int *used, const short *def, unsigned int defal, unsigned int maxsym, unsigned int maxal)
+{
+    short norm[ZSTD_FSE_MAXSYM + 1];
+    unsigned int a;
+
+    *used = 0;
+    switch (mode) {
+        /* predefined */
+        case 0:
+            *al = defal;
+            return zstd_fse_build(t, def, maxsym, defal);
+        /* a single symbol */
+        case 1:
+            if (!len || src[0] > maxsym) return ZSTD_DATA_ERROR;
+            t[0].symbol = src[0];
+            t[0].nbits = 0;
+            t[0].state = 0;
+            *al = 0;
+            *used = 1;
+            return ZSTD_OK;
+        /* compressed */
+        case 2:
+            if (zstd_fse_header(src, len, norm, maxsym, maxal, &a, used) != ZSTD_OK) return ZSTD_DATA_ERROR;
+            *al = a;
+            return zstd_fse_build(t, norm, maxsym, a);
+        /* same as in the previous block */
+        default:
+            return *al < 0 ? ZSTD_DATA_ERROR : ZSTD_OK;
+    }
+}
+
+/* ----------------------- *
+ * -- Huffman functions -- *
+ * ----------------------- */
+
+/* read a Huffman tree description and build its decoding table */
+static int zstd_huf_table(ZSTD_WORK *w, const unsigned char *src, unsigned int len, unsigned int *used)
+{
+    unsigned char weight[256];
+    unsigned int hdr, n = 0, i, j, total, maxbits, rest, al, u, s1, s2, rank[ZSTD_HUF_MAXBITS + 1];
+    short norm[13];
+    ZSTD_FSE t[64];
+    zstd_bits_t b;
+
+    if (!len) return ZSTD_DATA_ERROR;
+    hdr = src[0];
+    if (hdr >= 128) {
+        /* weights stored as 4 bit numbers */
+        n = hdr - 127;
+        *used = 1 + (n + 1) / 2;
+        if (*used > len) return ZSTD_DATA_ERROR;
+        for (i = 0; i < n; i++)
+            weight[i] = (src[1 + i / 2] >> ((i & 1) ? 0 : 4)) & 15;
+    } else {
+        /* FSE compressed weights, decoded with two interleaved states */
+        *used = 1 + hdr;
+        if (*used > len) return ZSTD_DATA_ERROR;
+        if (zstd_fse_header(src + 1, hdr, norm, 12, 6, &al, &u) != ZSTD_OK ||
+            zstd_fse_build(t, norm, 12, al) != ZSTD_OK ||
+            zstd_bits_init(&b, src + 1 + u, hdr - u) != ZSTD_OK)
+            return ZSTD_DATA_ERROR;
+        s1 = zstd_bits_read(&b, al);
+        s2 = zstd_bits_read(&b, al);
+        zstd_bits_reload(&b);
+        for (;;) {
+            if (n > 253) return ZSTD_DATA_ERROR;
+            weight[n++] = t[s1].symbol;
+            s1 = t[s1].state + zstd_bits_read(&b, t[s1].nbits);
+            zstd_bits_reload(&b);
+            if (b.consumed > 64) { weight[n++] = t[s2].symbol; break; }
+            weight[n++] = t[s2].symbol;
+            s2 = t[s2].state + zstd_bits_read(&b, t[s2].nbits);
+            zstd_bits_reload(&b);
+            if (b.consumed > 64) { weight[n++] = t[s1].symbol; break; }
+        }
+    }
+    /* the last weight is implied, it completes the sum to a power of 2 */
+    for (total = 0, i = 0; i < n; i++) {
+        if (weight[i] > ZSTD_HUF_MAXBITS) return ZSTD_DATA_ERROR;
+        if (weight[i]) total += 1 << (weight[i] - 1);
+    }
+    if (!total) return ZSTD_DATA_ERROR;
+    maxbits = zstd_highbit(total) + 1;
+    rest = (1 << maxbits) - total;
+    if (maxbits > ZSTD_HUF_MAXBITS || (rest & (rest - 1))) return ZSTD_DATA_ERROR;
+    weight[n++] = zstd_highbit(rest) + 1;
+    /* codes are assigned by increasing weight, then by symbol value */
+    for (i = 0; i <= maxbits; i++) rank[i] = 0;
+    for (i = 0; i < n; i++) rank[weight[i]]++;
+    for (total = 0, i = 1; i <= maxbits; i++) {
+        u = rank[i] << (i - 1);
+        rank[i] = total;
+        total += u;
+    }
+    for (i = 0; i < n; i++) {
+        if (!weight[i]) continue;
+        u = 1 << (weight[i] - 1);
+        for (j = rank[weight[i]]; j < rank[weight[i]] + u; j++)
+            w->huf[j] = (i << 8) | (maxbits + 1 - weight[i]);
+        rank[weight[i]] += u;
+    }
+    w->hufbits = maxbits;
+    return ZSTD_OK;
+}
+
+/* decode num literals from one Huffman coded stream */
+static int zstd_huf_stream(const ZSTD_WORK *w, const unsigned char *src, unsigned int len, unsigned char *dst,
+    unsigned int num)
+{
+    unsigned int e, bits = w->hufbits;
+    zstd_bits_t b;
+
+#define ZSTD_HUF_DECODE() e = w->huf[zstd_bits_look(&b, bits)]; b.consumed += e & 0xFF; *dst++ = e >> 8
+    if (zstd_bits_init(&b, src, len) != ZSTD_OK) return ZSTD_DATA_ERROR;
+    /* 4 symbols take at most 44 bits, reload after each group */
+    for (; num >= 4; num -= 4) {
+        ZSTD_HUF_DECODE();
+        ZSTD_HUF_DECODE();
+        ZSTD_HUF_DECODE();
+        ZSTD_HUF_DECODE();
+        zstd_bits_reload(&b);
+    }
+    while (num--) {
+        ZSTD_HUF_DECODE();
+    }
+#undef ZSTD_HUF_DECODE
+    return zstd_bits_end(&b) ? ZSTD_OK : ZSTD_DATA_ERROR;
+}
+
+/* --------------------- *
+ * -- block functions -- *
+ * --------------------- */
+
+/* decode the literals section of a block. Raw literals are used in place */
+static int zstd_literals(zstd_frame_t *f, const unsigned char *src, unsigned int len, unsigned int *used,
+    const unsigned char **lit, unsigned int *litlen)
+{
+    ZSTD_WORK *w = f->w;
+    unsigned int type, fmt, hsize, regen, comp, bits, u, q, s1, s2, s3;
+    unsigned long h;
+    const unsigned char *p;
+
+    if (!len) return ZSTD_DATA_ERROR;
+    type = src[0] & 3;
+    fmt = (src[0] >> 2) & 3;
+    *lit = w->lit;
+    if (type < 2) {
+        /* raw or a single repeated byte */
+        hsize = fmt == 1 ? 2 : fmt == 3 ? 3 : 1;
+        if (hsize >= len) return ZSTD_DATA_ERROR;
+        regen = fmt == 1 ? zstd_le16(src) >> 4 : fmt == 3 ? zstd_le24(src) >> 4 : src[0] >> 3;
+        if (regen > ZSTD_BLOCK_MAX) return ZSTD_DATA_ERROR;
+        if (!type) {
+            if (regen > len - hsize) return ZSTD_DATA_ERROR;
+            *lit = src + hsize;
+            *used = hsize + regen;
+        } else {
+            if (f->dst) zstd_fill(w->lit, src[hsize], regen);
+            *used = hsize + 1;
+        }
+        *litlen = regen;
+        return ZSTD_OK;
+    }
+    /* Huffman coded in one or four streams */
+    hsize = fmt < 2 ? 3 : fmt + 2;
+    if (hsize > len) return ZSTD_DATA_ERROR;
+    for (h = 0, u = 0; u < hsize; u++)
+        h |= (unsigned long)src[u] << (u * 8);
+    bits = fmt < 2 ? 10 : fmt == 2 ? 14 : 18;
+    regen = (h >> 4) & ((1 << bits) - 1);
+    comp = (h >> (4 + bits)) & ((1 << bits) - 1);
+    if (regen > ZSTD_BLOCK_MAX || comp > len - hsize) return ZSTD_DATA_ERROR;
+    *used = hsize + comp;
+    *litlen = regen;
+    /* only the size was asked */
+    if (!f->dst) return ZSTD_OK;
+    p = src + hsize;
+    if (type == 2) {
+        if (zstd_huf_table(w, p, comp, &u) != ZSTD_OK) return ZSTD_DATA_ERROR;
+        p += u;
+        comp -= u;
+    } else if (!w->hufbits)
+        return ZSTD_DATA_ERROR;
+    if (!fmt)
+        return zstd_huf_stream(w, p, comp, w->lit, regen);
+    /* jump table with the size of the first three streams */
+    if (comp < 6) return ZSTD_DATA_ERROR;
+    s1 = zstd_le16(p);
+    s2 = zstd_le16(p + 2);
+    s3 = zstd_le16(p + 4);
+    q = (regen + 3) / 4;
+    if (s1 + s2 + s3 > comp - 6 || 3 * q > regen) return ZSTD_DATA_ERROR;
+    p += 6;
+    if (zstd_huf_stream(w, p, s1, w->lit, q) != ZSTD_OK ||
+        zstd_huf_stream(w, p + s1, s2, w->lit + q, q) != ZSTD_OK ||
+        zstd_huf_stream(w, p + s1 + s2, s3, w->lit + 2 * q, q) != ZSTD_OK ||
+        zstd_huf_stream(w, p + s1 + s2 + s3, comp - 6 - s1 - s2 - s3, w->lit + 3 * q, regen - 3 * q) != ZSTD_OK)
+        return ZSTD_DATA_ERROR;
+    return ZSTD_OK;
+}
+
+/* decode the sequences section of a block and execute them */
+static int zstd_sequences(zstd_frame_t *f, const unsigned char *src, unsigned int len, const unsigned char *lit,
+    unsigned int litlen)
+{
+    ZSTD_WORK *w = f->w;
+    const unsigned char *litend = lit + litlen;
+    unsigned char *dst = f->dst;
+    unsigned int nseq, u, i, sll, sof, sml, ofc, offv, off, ml, ll, idx, pos = f->pos, size = f->size;
+    unsigned int rep[3] = { w->rep[0], w->rep[1], w->rep[2] };
+    zstd_bits_t b;
+
+    /* number of sequences */
+    if (!len) return ZSTD_DATA_ERROR;
+    if (src[0] < 128) {
+        nseq = src[0];
+        u = 1;
+    } else if (src[0] < 255) {
+        if (len < 2) return ZSTD_DATA_ERROR;
+        nseq = ((src[0] - 128) << 8) + src[1];
+        u = 2;
+    } else {
+        if (len < 3) return ZSTD_DATA_ERROR;
+        nseq = zstd_le16(src + 1) + 0x7F00;
+        u = 3;
+    }
+    if (nseq) {
+        /* compression modes and tables */
+        if (u >= len || (src[u] & 3)) return ZSTD_DATA_ERROR;
+        i = src[u++];
+        if (zstd_fse_table(w->ll, &w->llbits, i >> 6, src + u, len - u, &idx, zstd_ll_default, 6,
+                ZSTD_LL_MAXSYM, ZSTD_LL_MAXAL) != ZSTD_OK) return ZSTD_DATA_ERROR;
+        u += idx;
+        if (zstd_fse_table(w->of, &w->ofbits, (i >> 4) & 3, src + u, len - u, &idx, zstd_of_default, 5,
+                ZSTD_OF_MAXSYM, ZSTD_OF_MAXAL) != ZSTD_OK) return ZSTD_DATA_ERROR;
+        u += idx;
+        if (zstd_fse_table(w->ml, &w->mlbits, (i >> 2) & 3, src + u, len - u, &idx, zstd_ml_default, 6,
+                ZSTD_ML_MAXSYM, ZSTD_ML_MAXAL) != ZSTD_OK) return ZSTD_DATA_ERROR;
+        u += idx;
+        /* initial states */
+        if (zstd_bits_init(&b, src + u, len - u) != ZSTD_OK) return ZSTD_DATA_ERROR;
+        sll = zstd_bits_read(&b, w->llbits);
+        sof = zstd_bits_read(&b, w->ofbits);
+        sml = zstd_bits_read(&b, w->mlbits);
+        zstd_bits_reload(&b);
+        for (i = 0; i < nseq; i++) {
+            /* decode a sequence, extra bits are read in offset, match, literal length order */
+            ofc = w->of[sof].symbol;
+            offv = (1U << ofc) + zstd_bits_read(&b, ofc);
+            /* lengths take at most 32 bits */
+            if (ofc > 24) zstd_bits_reload(&b);
+            u = w->ml[sml].symbol;
+            ml = zstd_ml_base[u] + zstd_bits_read(&b, zstd_ml_bits[u]);
+            u = w->ll[sll].symbol;
+            ll = zstd_ll_base[u] + zstd_bits_read(&b, zstd_ll_bits[u]);
+            zstd_bits_reload(&b);
+            /* repeated offsets */
+            if (offv > 3) {
+                off = offv - 3;
+                rep[2] = rep[1];
+                rep[1] = rep[0];
+                rep[0] = off;
+            } else {
+                idx = offv - 1 + !ll;
+                if (!idx)
+                    off = rep[0];
+                else {
+                    off = idx == 3 ? rep[0] - 1 : rep[idx];
+                    if (idx != 1) rep[2] = rep[1];
+                    rep[1] = rep[0];
+                    rep[0] = off;
+                }
+            }
+            /* next states, in literal length, match length, offset order */
+            if (i + 1 < nseq) {
+                sll = w->ll[sll].state + zstd_bits_read(&b, w->ll[sll].nbits);
+                sml = w->ml[sml].state + zstd_bits_read(&b, w->ml[sml].nbits);
+                sof = w->of[sof].state + zstd_bits_read(&b, w->of[sof].nbits);
+                zstd_bits_reload(&b);
+            }
+            /* copy literals, then the match */
+            if (ll > (unsigned int)(litend - lit) || ll > size - pos) return ZSTD_DATA_ERROR;
+            if (dst) zstd_copy(dst + pos, lit, ll);
+            lit += ll;
+            pos += ll;
+            if (ml > size - pos || !off || off > pos - f->start) return ZSTD_DATA_ERROR;
+            if (dst) zstd_copy(dst + pos, dst + pos - off, ml);
+            pos += ml;
+        }
+        if (!zstd_bits_end(&b)) return ZSTD_DATA_ERROR;
+        w->rep[0] = rep[0];
+        w->rep[1] = rep[1];
+        w->rep[2] = rep[2];
+    } else if (u != len)
+        return ZSTD_DATA_ERROR;
+    /* remaining literals */
+    ll = litend - lit;
+    if (ll > size - pos) return ZSTD_DATA_ERROR;
+    if (dst) zstd_copy(dst + pos, lit, ll);
+    f->pos = pos + ll;
+    return ZSTD_OK;
+}
+
+/* ------------------------------- *
+ * -- frame decoding (interface) -- *
+ * ------------------------------- */
+
+int zstd_uncompress(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen, ZSTD_WORK *work)
+{
+    const unsigned char *end = src + srclen, *lit;
+    unsigned int fhd, hsize, dictlen, fcslen, blk, type, bsize, u, litlen;
+    unsigned long fcs;
+    zstd_frame_t f;
+
+    f.w = work;
+    f.dst = dst;
+    f.pos = 0;
+    f.size = dst ? *dstlen : ~0U;
+    /* the first frame must be there, anything after the last one is padding */
+    if (srclen < 4 || zstd_le32(src) != ZSTD_MAGIC) return ZSTD_DATA_ERROR;
+    while (end - src >= 4) {
+        /* skippable frames */
+        if ((zstd_le32(src) & 0xFFFFFFF0) == 0x184D2A50) {
+            if (end - src < 8 || zstd_le32(src + 4) > (unsigned int)(end - src - 8)) return ZSTD_DATA_ERROR;
+            src += 8 + zstd_le32(src + 4);
+            continue;
+        }
+        if (zstd_le32(src) != ZSTD_MAGIC) break;
+        /* frame header, the window descriptor is not needed as the whole
+           output is kept in memory */
+        if (end - src < 5) return ZSTD_DATA_ERROR;
+        fhd = src[4];
+        dictlen = (1 << (fhd & 3)) >> 1;
+        fcslen = (fhd >> 6) ? 1 << (fhd >> 6) : (fhd & ZSTD_FHD_SINGLE) ? 1 : 0;
+        hsize = 5 + !(fhd & ZSTD_FHD_SINGLE) + dictlen + fcslen;
+        if ((fhd & ZSTD_FHD_RESERVED) || (unsigned int)(end - src) < hsize) return ZSTD_DATA_ERROR;
+        src += hsize - fcslen - dictlen;
+        /* dictionaries are not supported */
+        for (u = 0; u < dictlen; u++)
+            if (*src++) return ZSTD_DATA_ERROR;
+        for (fcs = 0, u = 0; u < fcslen; u++)
+            fcs |= (unsigned long)*src++ << (u * 8);
+        if (fcslen == 2) fcs += 256;
+        f.start = f.pos;
+        work->llbits = work->ofbits = work->mlbits = -1;
+        work->hufbits = 0;
+        work->rep[0] = 1;
+        work->rep[1] = 4;
+        work->rep[2] = 8;
+        /* when only the size is asked and it's recorded, no need to decompress */
+        if (!dst && fcslen) {
+            if (fcs > f.size - f.pos) return ZSTD_DATA_ERROR;
+            f.pos += fcs;
+        }
+        /* blocks */
+        do {
+            if (end - src < 3) return ZSTD_DATA_ERROR;
+            blk = zstd_le24(src);
+            src += 3;
+            type = (blk >> 1) & 3;
+            bsize = blk >> 3;
+            if (type == 3 || (type == 1 ? 1 : bsize) > (unsigned int)(end - src)) return ZSTD_DATA_ERROR;
+            if (!dst && fcslen) {
+                /* already accounted for */
+            } else if (type != 2) {
+                /* raw or a single repeated byte */
+                if (bsize > f.size - f.pos) return ZSTD_DATA_ERROR;
+                if (dst) {
+                    if (type) zstd_fill(dst + f.pos, src[0], bsize);
+                    else zstd_copy(dst + f.pos, src, bsize);
+                }
+                f.pos += bsize;
+            } else {
+                if (bsize > ZSTD_BLOCK_MAX ||
+                    zstd_literals(&f, src, bsize, &u, &lit, &litlen) != ZSTD_OK ||
+                    zstd_sequences(&f, src + u, bsize - u, lit, litlen) != ZSTD_OK)
+                    return ZSTD_DATA_ERROR;
+            }
+            src += type == 1 ? 1 : bsize;
+        } while (!(blk & 1));
+        /* content size and checksum */
+        if (dst && fcslen && fcs != f.pos - f.start) return ZSTD_DATA_ERROR;
+        if (fhd & ZSTD_FHD_CHKSUM) {
+            if (end - src < 4) return ZSTD_DATA_ERROR;
+            if (dst && (unsigned int)zstd_xxh64(dst + f.start, f.pos - f.start, 0) != zstd_le32(src))
+                return ZSTD_CHKSUM_ERROR;
+            src += 4;
+        }
+    }
+    *dstlen = f.pos;
+    return ZSTD_OK;
+}
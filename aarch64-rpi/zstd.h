@@ -0,0 +1,73 @@
+/*
+ * aarch64-rpi/zstd.h
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Tiny allocation-free Zstandard decoder
+ *
+ */
+
+#ifndef ZSTD_H_INCLUDED
+#define ZSTD_H_INCLUDED
+
+#define ZSTD_OK             0
+#define ZSTD_DATA_ERROR    (-3)
+#define ZSTD_CHKSUM_ERROR  (-4)
+
+/* first bytes of a Zstandard frame, 28 B5 2F FD */
+#define ZSTD_MAGIC         0xFD2FB528
+
+/* maximum size of a block and of a Huffman code */
+#define ZSTD_BLOCK_MAX     (128*1024)
+#define ZSTD_HUF_MAXBITS   11
+
+/* FSE decoding table entry */
+typedef struct {
+    unsigned char symbol;
+    unsigned char nbits;
+    unsigned short state;
+} ZSTD_FSE;
+
+/* Decoder workspace, the window is the output buffer itself */
+typedef struct {
+    ZSTD_FSE ll[1 << 9];        /* literal lengths table */
+    ZSTD_FSE of[1 << 8];        /* offsets table */
+    ZSTD_FSE ml[1 << 9];        /* match lengths table */
+    int llbits, ofbits, mlbits; /* accuracy logs, -1 if not set yet */
+    unsigned short huf[1 << ZSTD_HUF_MAXBITS]; /* literals, symbol << 8 | code length */
+    unsigned int hufbits;       /* 0 if not set yet */
+    unsigned int rep[3];        /* repeated offsets */
+    unsigned char lit[ZSTD_BLOCK_MAX]; /* decoded literals of a block */
+} ZSTD_WORK;
+
+/* Decompress concatenated Zstandard frames without dictionary. If dst is
+   NULL, only the uncompressed size is returned in dstlen, otherwise dstlen
+   is the size of dst on entry and the number of bytes written on return.
+   work must point to sizeof(ZSTD_WORK) bytes */
+int zstd_uncompress(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen, ZSTD_WORK *work);
+
+/* xxHash64 used by the frame checksum, seed is 0 for Zstandard */
+unsigned long zstd_xxh64(const void *data, unsigned int length, unsigned long seed);
+
+#endif /* ZSTD_H_INCLUDED */
@@ -110,16 +110,16 @@ typedef struct {
       uint64_t smbi_ptr;
       uint64_t efi_ptr;
       uint64_t mp_ptr;
-      uint64_t unused0;
-      uint64_t unused1;
+      uint64_t fidx_ptr;
+      uint64_t gzidx_ptr;
       uint64_t unused2;
       uint64_t unused3;
     } x86_64;
     struct {
       uint64_t acpi_ptr;
       uint64_t mmio_ptr;
-      uint64_t unused0;
-      uint64_t unused1;
+      uint64_t fidx_ptr;
+      uint64_t gzidx_ptr;
       uint64_t unused2;
       uint64_t unused3;
       uint64_t unused4;
@@ -134,6 +134,62 @@ typedef struct {
    * until you reach bootboot->size */
 } __attribute__((packed)) BOOTBOOT;
 
+// initrd file table, passed in fidx_ptr (physical address, 0 if the loader
+// didn't recognize the initrd's format). Buckets are at the end of the header,
+// records of bucket b are files[bucket[b]] .. files[bucket[b+1]-1], where b is
+// the top hashbits bits of the path's FNV-1a hash
+#define INITRD_IDX_MAGIC "FIDX"
+
+typedef struct {
+  uint8_t    magic[4];    // 'FIDX'
+  uint32_t   size;        // length of the table, page aligned
+  uint32_t   numfiles;    // number of file records
+  uint32_t   hashbits;    // number of buckets is 1 << hashbits
+  uint32_t   files;       // offset of the file records
+  uint32_t   names;       // offset of the zero terminated paths
+  /* followed by uint32_t bucket[(1<<hashbits)+1] */
+} __attribute__((packed)) INITRD_IDX;
+
+typedef struct {
+  uint32_t   hash;        // FNV-1a hash of the path
+  uint32_t   name;        // offset of the path from the table's start
+  uint64_t   ptr;         // file's data in the initrd
+  uint64_t   size;
+} __attribute__((packed)) INITRD_FILE;
+
+// BOOTBOOT native initrd. It starts with a directory in the same layout as the
+// file table above, with 'BBFS' magic and offsets from the image's start in
+// place of pointers. The directory's size is the offset of the first file,
+// file data is page aligned
+#define INITRD_BBFS_MAGIC "BBFS"
+#define INITRD_BBFS_GZIP  1       // data is gzip compressed, size is the compressed size
+
+typedef struct {
+  uint32_t   hash;        // FNV-1a hash of the path
+  uint32_t   name;        // offset of the zero terminated path
+  uint64_t   offset;      // offset of the data, page aligned
+  uint64_t   size;        // size of the data as stored
+  uint32_t   flags;       // INITRD_BBFS_*
+  uint32_t   reserved;
+} __attribute__((packed)) INITRD_BBFS_FILE;
+
+// seekable gzip initrd. The deflate stream is fully flushed after every chunk
+// bytes of uncompressed data, so each chunk can be inflated on its own without
+// the preceding ones. The index is the first subfield ('BX') of the gzip
+// header's extra field, passed in gzidx_ptr (physical address, 0 if the initrd
+// is not seekable). In that case the initrd is passed compressed, only the
+// files the loader needs are inflated (placed after the image on RPi)
+#define INITRD_GZIDX_MAGIC "GZIX"
+
+typedef struct {
+  uint8_t    magic[4];    // 'GZIX'
+  uint32_t   chunk;       // uncompressed size of a chunk (multiple of 4096), the last may be shorter
+  uint32_t   numchunks;
+  uint32_t   size;        // uncompressed size of the image
+  /* followed by uint32_t offs[numchunks+1], offset of each chunk's deflate
+   * data from the image's start, the last one is the end of the stream */
+} __attribute__((packed)) INITRD_GZIDX;
+
 
 #ifdef  __cplusplus
 }
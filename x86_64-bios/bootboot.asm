@@ -762,6 +762,17 @@ prot_readsectorfunc:
             pop         eax
             ret
 
+;eax cluster, returns next cluster from the FAT loaded at 10000h in eax
+prot_fatnext:
+            cmp         byte [fattype], 0
+            jz          @f
+            ;top 4 bits of a FAT32 entry are reserved
+            mov         eax, dword [eax*4+10000h]
+            and         eax, 0FFFFFFFh
+            ret
+@@:         movzx       eax, word [eax*2+10000h]
+            ret
+
 prot_hex2bin:
             xor         eax, eax
             xor         ebx, ebx
@@ -1094,16 +1105,7 @@ protmode_start:
             js          .cfgloaded
             jz          .cfgloaded
             ;get next cluster from FAT
-            cmp         byte [fattype], 0
-            jz          @f
-            shl         eax, 2
-            add         eax, 0x10000
-            mov         eax, dword [eax]
-            jmp         .nextcfg
-@@:         shl         eax, 1
-            add         eax, 0x10000
-            mov         ax, word [eax]
-            and         eax, 0FFFFh
+            call        prot_fatnext
             jmp         .nextcfg
 .cfgloaded: pop         ecx
             pop         edi
@@ -1150,33 +1152,46 @@ protmode_start:
 .loadinitrd:
             mov         edi, dword [bootboot.initrd_ptr]
 .nextclu:   push        eax
+            ;merge consecutive clusters into one read, edx=sectors, ebx=last cluster.
+            ;The bounce buffer at 0A000h holds 48 sectors below the FAT
+            mov         edx, dword [clu_sec]
+            mov         ebx, eax
+.nextrun:   mov         esi, edx
+            shl         esi, 9
+            cmp         esi, ecx
+            jae         .readrun
+            mov         esi, edx
+            add         esi, dword [clu_sec]
+            cmp         esi, 48
+            ja          .readrun
+            mov         eax, ebx
+            call        prot_fatnext
+            inc         ebx
+            cmp         eax, ebx
+            je          @f
+            dec         ebx
+            jmp         .readrun
+@@:         mov         edx, esi
+            jmp         .nextrun
+.readrun:   pop         eax
+            push        ebx
+            push        edx
+            mov         word [lbapacket.count], dx
             ;sec = (cluster-2)*secPerCluster+data_sec
             sub         eax, 2
             xor         edx, edx
-            mov         ebx, dword [clu_sec]
-            mov         word [lbapacket.count], bx
-            mul         ebx
-            shl         ebx, 9
+            mul         dword [clu_sec]
             add         eax, dword [data_sec]
-            push        ebx
             prot_readsector
             pop         ebx
+            shl         ebx, 9
             pop         eax
             add         edi, ebx
             sub         ecx, ebx
             js          .initrdloaded
             jz          .initrdloaded
             ;get next cluster from FAT
-            cmp         byte [fattype], 0
-            jz          @f
-            shl         eax, 2
-            add         eax, 0x10000
-            mov         eax, dword [eax]
-            jmp         .nextclu
-@@:         shl         eax, 1
-            add         eax, 0x10000
-            mov         ax, word [eax]
-            and         eax, 0FFFFh
+            call        prot_fatnext
             jmp         .nextclu
 
 .initrdloaded:
@@ -1184,6 +1199,8 @@ protmode_start:
             mov         esi, dword [bootboot.initrd_ptr]
 .initrdrom:
             mov         edi, dword [bootboot.initrd_ptr]
+            cmp         dword [esi], 184D2204h
+            je          .lz4initrd
             cmp         word [esi], 08b1fh
             jne         .noinflate
             DBG32       dbg_gzinitrd
@@ -1230,6 +1247,19 @@ protmode_start:
             jz          @f
             add         esi, 2
 @@:         call        tinf_uncompress
+            jmp         .noinflate
+.lz4initrd: DBG32       dbg_lz4initrd
+            ; uncompress after the frame, the size is only known at the end
+            mov         ecx, edi
+            add         edi, dword [bootboot.initrd_size]
+            add         edi, 4095
+            shr         edi, 12
+            shl         edi, 12
+            add         ecx, (INITRD_MAXSIZE+2)*1024*1024
+            mov         dword [bootboot.initrd_ptr], edi
+            call        lz4_uncompress
+            sub         edi, dword [bootboot.initrd_ptr]
+            mov         dword [bootboot.initrd_size], edi
 .noinflate:
             ;round up to page size
             mov         eax, dword [bootboot.initrd_size]
@@ -1841,6 +1871,7 @@ longmode_init:
             USE32
             include     "fs.inc"
             include     "tinf.inc"
+            include     "lz4.inc"
 
 ;*********************************************************************
 ;*                               Data                                *
@@ -1894,6 +1925,7 @@ dbg_time    db          " * System time",10,13,0
 dbg_env     db          " * Environment",10,13,0
 dbg_initrd  db          " * Initrd loaded",10,13,0
 dbg_gzinitrd db         " * Gzip compressed initrd",10,13,0
+dbg_lz4initrd db        " * LZ4 compressed initrd",10,13,0
 dbg_scan    db          " * Autodetecting kernel",10,13,0
 dbg_elf     db          " * Parsing ELF64",10,13,0
 dbg_pe      db          " * Parsing PE32+",10,13,0
@@ -1933,31 +1965,25 @@ store byte (100h-chksum) at (loader.checksum)
 ;-----------bss area-----------
 tinf_bss_start:
 d_end:      dd          ?
-d_lzOff:    dd          ?
-d_dict_ring:dd          ?
-d_dict_size:dd          ?
-d_dict_idx: dd          ?
-d_tag:      db          ?
-d_bitcount: db          ?
 d_bfinal:   db          ?
-d_curlen:   dw          ?
-d_ltree:
-d_ltree_table:
-            dw          16 dup ?
-d_ltree_trans:
+;TINF_TREE: code length counts, symbols sorted by code, lookup table
+tree_trans = 32
+tree_fast = 32+2*288
+d_ltree:    dw          16 dup ?
             dw          288 dup ?
-d_dtree:
-d_dtree_table:
-            dw          16 dup ?
-d_dtree_trans:
+            dw          512 dup ?
+d_dtree:    dw          16 dup ?
             dw          288 dup ?
+            dw          512 dup ?
 offs:       dw          16 dup ?
+nextc:      dw          16 dup ?
 num:        dw          ?
 lengths:    db          320 dup ?
 hlit:       dw          ?
 hdist:      dw          ?
 hclen:      dw          ?
 tinf_bss_end:
+lz4_start:  dd          ?
 
 ;-----------bound check-------------
 ;fasm will generate an error if the code
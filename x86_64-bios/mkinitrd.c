@@ -0,0 +1,365 @@
+/*
+ * x86_64-bios/mkinitrd.c
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Little tool to create a BOOTBOOT native initrd from a directory
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "../bootboot.h"
+
+#define PAGESIZE 4096
+#define CHUNKSIZE (1024*1024)
+
+typedef struct {
+    char *name;
+    unsigned char *data;
+    uint64_t size;
+    uint32_t hash;
+    uint32_t flags;
+} entry_t;
+
+entry_t *ent = NULL;
+int nent = 0, gzipfiles = 0, seekable = 0;
+
+/**
+ * FNV-1a hash of a path, same as the loaders use
+ */
+uint32_t fs_hash(unsigned char *s, uint32_t len)
+{
+    uint32_t h=2166136261U;
+    while(len--) { h^=*s++; h*=16777619U; }
+    return h;
+}
+
+/**
+ * gzip a file, keep it only if it got smaller. The loader must be able to
+ * map the kernel and read the config, so those are always stored as is. The
+ * kernel may have any name (kernel= in the config), so no ELF or PE
+ * executable is compressed
+ */
+void gzip_entry(entry_t *e)
+{
+    z_stream z;
+    unsigned char *out;
+    uLong len;
+    if(!e->size || !strcmp(e->name,"sys/core") || !strcmp(e->name,"sys/config") ||
+        (e->size>=4 && !memcmp(e->data,"\177ELF",4)) || (e->size>=2 && e->data[0]=='M' && e->data[1]=='Z'))
+        return;
+    memset(&z,0,sizeof(z));
+    if(deflateInit2(&z,9,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+        return;
+    len=deflateBound(&z,e->size);
+    out=malloc(len);
+    if(out==NULL) { deflateEnd(&z); return; }
+    z.next_in=e->data; z.avail_in=e->size;
+    z.next_out=out; z.avail_out=len;
+    if(deflate(&z,Z_FINISH)==Z_STREAM_END && z.total_out<e->size) {
+        free(e->data);
+        e->data=out;
+        e->size=z.total_out;
+        e->flags|=INITRD_BBFS_GZIP;
+    } else
+        free(out);
+    deflateEnd(&z);
+}
+
+/**
+ * write the image as a seekable gzip. The deflate stream is fully flushed after
+ * every chunk, so the loader can inflate any of them on its own. The chunks'
+ * offsets go to an index in the gzip header's extra field
+ */
+int gzip_seekable(FILE *f, unsigned char *data, uint64_t size)
+{
+    z_stream z;
+    INITRD_GZIDX idx;
+    unsigned char *out, hdr[16];
+    uint32_t *offs, i, hdrsize, crc;
+    uLong len;
+    memset(&idx,0,sizeof(idx));
+    memcpy(idx.magic,INITRD_GZIDX_MAGIC,4);
+    idx.chunk=CHUNKSIZE;
+    idx.numchunks=(size+CHUNKSIZE-1)/CHUNKSIZE;
+    idx.size=size;
+    hdrsize=sizeof(hdr)+sizeof(idx)+(idx.numchunks+1)*sizeof(uint32_t);
+    // the extra field's length is 16 bits
+    if(size>0xFFFFFFFFUL || hdrsize-12>0xFFFF) {
+        fprintf(stderr,"mkinitrd: image is too big for a seekable gzip\n");
+        return 0;
+    }
+    memset(&z,0,sizeof(z));
+    if(deflateInit2(&z,9,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY)!=Z_OK)
+        return 0;
+    len=deflateBound(&z,size)+idx.numchunks*16;
+    out=malloc(len);
+    offs=malloc((idx.numchunks+1)*sizeof(uint32_t));
+    if(out==NULL || offs==NULL) {
+        fprintf(stderr,"mkinitrd: unable to allocate memory\n");
+        return 0;
+    }
+    z.next_out=out; z.avail_out=len;
+    for(i=0;i<idx.numchunks;i++) {
+        offs[i]=hdrsize+z.total_out;
+        z.next_in=data+(uint64_t)i*CHUNKSIZE;
+        z.avail_in=size-(uint64_t)i*CHUNKSIZE<CHUNKSIZE?size-(uint64_t)i*CHUNKSIZE:CHUNKSIZE;
+        if(deflate(&z,i+1<idx.numchunks?Z_FULL_FLUSH:Z_FINISH)!=(i+1<idx.numchunks?Z_OK:Z_STREAM_END)) {
+            fprintf(stderr,"mkinitrd: unable to compress\n");
+            return 0;
+        }
+    }
+    offs[i]=hdrsize+z.total_out;
+    // gzip header with FEXTRA, the index is its 'BX' subfield
+    memset(hdr,0,sizeof(hdr));
+    hdr[0]=0x1f; hdr[1]=0x8b; hdr[2]=8; hdr[3]=4; hdr[8]=2; hdr[9]=3;
+    hdr[10]=(hdrsize-12)&0xFF; hdr[11]=(hdrsize-12)>>8;
+    hdr[12]='B'; hdr[13]='X';
+    hdr[14]=(hdrsize-16)&0xFF; hdr[15]=(hdrsize-16)>>8;
+    fwrite(hdr,1,sizeof(hdr),f);
+    fwrite(&idx,1,sizeof(idx),f);
+    fwrite(offs,sizeof(uint32_t),idx.numchunks+1,f);
+    fwrite(out,1,z.total_out,f);
+    // trailer, crc32 and size
+    crc=crc32(0L,Z_NULL,0);
+    crc=crc32(crc,data,size);
+    fwrite(&crc,1,4,f);
+    fwrite(&idx.size,1,4,f);
+    deflateEnd(&z);
+    free(out);
+    free(offs);
+    return 1;
+}
+
+/**
+ * read a file into an entry
+ */
+int add_file(char *path, char *name, uint64_t size)
+{
+    FILE *f;
+    entry_t *e;
+    ent=realloc(ent,(nent+1)*sizeof(entry_t));
+    if(ent==NULL) {
+        fprintf(stderr,"mkinitrd: unable to allocate memory\n");
+        return 0;
+    }
+    e=&ent[nent];
+    memset(e,0,sizeof(entry_t));
+    e->name=strdup(name);
+    e->size=size;
+    e->data=malloc(size+1);
+    f=fopen(path,"rb");
+    if(e->name==NULL || e->data==NULL || f==NULL || fread(e->data,1,size,f)!=size) {
+        if(f) fclose(f);
+        fprintf(stderr,"mkinitrd: unable to read %s\n",path);
+        return 0;
+    }
+    fclose(f);
+    e->hash=fs_hash((unsigned char*)e->name,strlen(e->name));
+    if(gzipfiles)
+        gzip_entry(e);
+    nent++;
+    return 1;
+}
+
+/**
+ * walk a directory recursively, paths are stored relative to the root
+ */
+int add_dir(char *root, char *rel)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char path[4096], name[4096];
+    int ret=1;
+    snprintf(path,sizeof(path),"%s%s%s",root,rel[0]?"/":"",rel);
+    dir=opendir(path);
+    if(dir==NULL) {
+        fprintf(stderr,"mkinitrd: unable to open directory %s\n",path);
+        return 0;
+    }
+    while(ret && (de=readdir(dir))!=NULL) {
+        if(!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
+            continue;
+        if(snprintf(name,sizeof(name),"%s%s%s",rel,rel[0]?"/":"",de->d_name)>=(int)sizeof(name) ||
+            snprintf(path,sizeof(path),"%s/%s",root,name)>=(int)sizeof(path)) {
+            fprintf(stderr,"mkinitrd: path too long %s/%s\n",rel,de->d_name);
+            ret=0;
+            break;
+        }
+        if(stat(path,&st))
+            continue;
+        if(S_ISDIR(st.st_mode))
+            ret=add_dir(root,name);
+        else if(S_ISREG(st.st_mode))
+            ret=add_file(path,name,st.st_size);
+    }
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * lay out the collected entries and write the image to f
+ */
+int write_image(FILE *f)
+{
+    INITRD_IDX *hdr;
+    INITRD_BBFS_FILE *file;
+    unsigned char *dir, *img, zero[PAGESIZE];
+    uint32_t *bucket, i, b, nb, hashbits, namesize=0, dirsize;
+    uint64_t offs;
+    int *order;
+
+    // the same layout as the file table passed to the kernel
+    for(hashbits=1;hashbits<24 && (1U<<hashbits)<(uint32_t)nent;hashbits++);
+    nb=1<<hashbits;
+    for(i=0;i<(uint32_t)nent;i++)
+        namesize+=strlen(ent[i].name)+1;
+    b=(sizeof(INITRD_IDX)+(nb+1)*sizeof(uint32_t)+7)&~7;
+    dirsize=(b+nent*sizeof(INITRD_BBFS_FILE)+namesize+PAGESIZE-1)&~(PAGESIZE-1);
+    dir=calloc(1,dirsize);
+    order=malloc(nent*sizeof(int));
+    if(dir==NULL || order==NULL) {
+        fprintf(stderr,"mkinitrd: unable to allocate memory\n");
+        return 2;
+    }
+    hdr=(INITRD_IDX*)dir;
+    memcpy(hdr->magic,INITRD_BBFS_MAGIC,4);
+    hdr->size=dirsize;
+    hdr->numfiles=nent;
+    hdr->hashbits=hashbits;
+    hdr->files=b;
+    hdr->names=b+nent*sizeof(INITRD_BBFS_FILE);
+    bucket=(uint32_t*)(dir+sizeof(INITRD_IDX));
+    file=(INITRD_BBFS_FILE*)(dir+hdr->files);
+    // count the files in each bucket and turn the counts into start indices
+    for(i=0;i<(uint32_t)nent;i++)
+        bucket[(ent[i].hash>>(32-hashbits))+1]++;
+    for(i=0;i<nb;i++)
+        bucket[i+1]+=bucket[i];
+    for(i=0;i<(uint32_t)nent;i++)
+        order[bucket[ent[i].hash>>(32-hashbits)]++]=i;
+    // each bucket's counter stopped at the next one's start, shift them back
+    for(i=nb;i>0;i--)
+        bucket[i]=bucket[i-1];
+    bucket[0]=0;
+    // fill in the records in bucket order, data follows the directory
+    namesize=hdr->names;
+    offs=dirsize;
+    for(i=0;i<(uint32_t)nent;i++) {
+        entry_t *e=&ent[order[i]];
+        file[i].hash=e->hash;
+        file[i].name=namesize;
+        file[i].offset=offs;
+        file[i].size=e->size;
+        file[i].flags=e->flags;
+        strcpy((char*)dir+namesize,e->name);
+        namesize+=strlen(e->name)+1;
+        offs+=(e->size+PAGESIZE-1)&~(PAGESIZE-1);
+    }
+    if(seekable) {
+        // the whole image is needed in memory to compress it in chunks
+        img=calloc(1,offs);
+        if(img==NULL) {
+            fprintf(stderr,"mkinitrd: unable to allocate memory\n");
+            return 2;
+        }
+        memcpy(img,dir,dirsize);
+        for(i=0;i<(uint32_t)nent;i++)
+            memcpy(img+file[i].offset,ent[order[i]].data,ent[order[i]].size);
+        i=gzip_seekable(f,img,offs);
+        free(img);
+        free(order);
+        free(dir);
+        return i?0:2;
+    }
+    memset(zero,0,sizeof(zero));
+    fwrite(dir,1,dirsize,f);
+    for(i=0;i<(uint32_t)nent;i++) {
+        entry_t *e=&ent[order[i]];
+        fwrite(e->data,1,e->size,f);
+        if(e->size & (PAGESIZE-1))
+            fwrite(zero,1,PAGESIZE-(e->size & (PAGESIZE-1)),f);
+    }
+    free(order);
+    free(dir);
+    return 0;
+}
+
+/* entry point */
+int main(int argc, char** argv)
+{
+    // variables
+    FILE *f;
+    int ret;
+
+    // check arguments
+    while(argc > 1 && argv[1][0]=='-') {
+        if(!strcmp(argv[1],"-z"))
+            gzipfiles=1;
+        else if(!strcmp(argv[1],"-s"))
+            seekable=1;
+        else
+            break;
+        argv++; argc--;
+    }
+    if(argc < 3) {
+        printf( "BOOTBOOT mkinitrd utility - bztsrc@github\n\nUsage:\n"
+                "  ./mkinitrd [-z] [-s] <directory> <output>\n\n"
+                "Creates a BOOTBOOT native initrd from a directory. The loader finds the kernel\n"
+                "with a single hash lookup, and the file data is page aligned so it can be mapped\n"
+                "in place. With -z, files are gzip compressed if that makes them smaller; those\n"
+                "are left for the kernel to uncompress. sys/config, sys/core and ELF or PE\n"
+                "executables (the kernel may be named otherwise in the config) are never\n"
+                "compressed.\n"
+                "With -s, the image is written as a seekable gzip, the loader only inflates the\n"
+                "parts holding sys/config and sys/core, and passes the rest compressed.\n\n"
+                "Examples:\n"
+                "  ./mkinitrd initrd INITRD     - create an initrd\n"
+                "  ./mkinitrd -z initrd INITRD  - create an initrd with compressed files\n"
+                "  ./mkinitrd -s initrd INITRD  - create a seekable gzip compressed initrd\n");
+        return 1;
+    }
+    if(!add_dir(argv[1],""))
+        return 2;
+    if(!nent) {
+        fprintf(stderr,"mkinitrd: no files found\n");
+        return 2;
+    }
+    // write out
+    f=fopen(argv[2],"wb");
+    if(f==NULL) {
+        fprintf(stderr,"mkinitrd: unable to write %s\n",argv[2]);
+        return 2;
+    }
+    ret=write_image(f);
+    fclose(f);
+    return ret;
+}
@@ -0,0 +1,764 @@
+/*
+ * x86_64-efi/benchfs.c
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Hosted lookup benchmark for the initrd file system drivers
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* mkinitrd lays out the BOOTBOOT native and seekable gzip images */
+#define main mkinitrd_main
+#define fs_hash mkinitrd_hash
+#include "../x86_64-bios/mkinitrd.c"
+#undef main
+#undef fs_hash
+
+/* thin shims for the UEFI environment fs.h was written for */
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef uint64_t UINTN;
+typedef uint16_t CHAR16;
+typedef uint64_t EFI_PHYSICAL_ADDRESS;
+typedef int EFI_STATUS;
+#define EFI_PAGE_SIZE 4096
+#define CompareMem(a,b,n) memcmp(a,b,n)
+#define CopyMem(a,b,n) memcpy(a,b,n)
+#define ZeroMem(a,n) memset(a,0,n)
+#define strlena(s) strlen((char*)(s))
+#define DBG(...)
+#define uefi_call_wrapper(f, n, ...) f(__VA_ARGS__)
+/* page allocations are recorded, as fs.h may free the tail of one and keep the rest */
+struct { EFI_PHYSICAL_ADDRESS addr; UINTN pages; } allocs[256];
+EFI_STATUS AllocatePages(int type, int memtype, UINTN pages, EFI_PHYSICAL_ADDRESS *addr)
+{
+    int i;
+    (void)type; (void)memtype;
+    for(i = 0; i < 256 && allocs[i].addr; i++);
+    if(i == 256) return 1;
+    *addr = (EFI_PHYSICAL_ADDRESS)aligned_alloc(EFI_PAGE_SIZE, pages * EFI_PAGE_SIZE);
+    allocs[i].addr = *addr; allocs[i].pages = pages;
+    return *addr ? 0 : 1;
+}
+EFI_STATUS FreePages(EFI_PHYSICAL_ADDRESS addr, UINTN pages)
+{
+    int i;
+    for(i = 0; i < 256; i++)
+        if(allocs[i].addr && addr >= allocs[i].addr && addr < allocs[i].addr + allocs[i].pages * EFI_PAGE_SIZE) {
+            if(addr + pages * EFI_PAGE_SIZE != allocs[i].addr + allocs[i].pages * EFI_PAGE_SIZE) break;
+            /* the head is kept until release() */
+            if(addr > allocs[i].addr) { allocs[i].pages = (addr - allocs[i].addr) / EFI_PAGE_SIZE; return 0; }
+            free((void*)addr);
+            allocs[i].addr = 0;
+            return 0;
+        }
+    fprintf(stderr, "benchfs: bad FreePages(%lx, %ld)\n", (unsigned long)addr, (long)pages);
+    exit(3);
+}
+/* free the allocation holding ptr, if it was made by AllocatePages */
+void release(void *ptr)
+{
+    int i;
+    for(i = 0; ptr && i < 256; i++)
+        if(allocs[i].addr && (EFI_PHYSICAL_ADDRESS)ptr >= allocs[i].addr &&
+            (EFI_PHYSICAL_ADDRESS)ptr < allocs[i].addr + allocs[i].pages * EFI_PAGE_SIZE) {
+            free((void*)allocs[i].addr);
+            allocs[i].addr = 0;
+            return;
+        }
+}
+struct { EFI_STATUS (*AllocatePages)(int, int, UINTN, EFI_PHYSICAL_ADDRESS*);
+    EFI_STATUS (*FreePages)(EFI_PHYSICAL_ADDRESS, UINTN); } bs = { AllocatePages, FreePages }, *BS = &bs;
+
+int oct2bin(unsigned char *str, int size)
+{
+    int s = 0;
+    while(size-- > 0) { s *= 8; s += *str++ - '0'; }
+    return s;
+}
+
+int hex2bin(unsigned char *str, int size)
+{
+    int v = 0;
+    while(size-- > 0) {
+        v <<= 4;
+        if(*str >= '0' && *str <= '9') v += *str - '0';
+        else if(*str >= 'A' && *str <= 'F') v += *str - 'A' + 10;
+        str++;
+    }
+    return v;
+}
+
+CHAR16 *a2u(char *str) { return (CHAR16*)str; }
+
+#include "tinf.h"
+#include "lz4.h"
+#include "zstd.h"
+#define _BOOTBOOT_LOADER 1
+#include "../bootboot.h"
+#ifdef FSZ_H
+#include FSZ_H
+#else
+#include "../../osZ/etc/include/fsZ.h"
+#endif
+#include "fs.h"
+
+/* how many times each measurement is repeated, the best is reported */
+#define ROUNDS 5
+
+char **paths;                   /* file names in the generated image */
+int numpaths;
+unsigned char *img;             /* the image being generated */
+UINT64 imgsize, imgpos;
+
+/* file contents are the path followed by a newline, so results can be checked */
+int datalen(int i) { return strlen(paths[i]) + 1; }
+void putdata(unsigned char *dst, int i) { memcpy(dst, paths[i], datalen(i) - 1); dst[datalen(i) - 1] = '\n'; }
+
+/* names like d3/d7/f0000037, files are spread over 10 subdirectories per level */
+void mkpaths(int n, int depth)
+{
+    char tmp[256];
+    int i, j, l, d;
+    paths = malloc(n * sizeof(char*));
+    for(i = 0; i < n; i++) {
+        for(j = l = 0, d = i; j < depth; j++, d /= 10)
+            l += sprintf(tmp + l, "d%d/", d % 10);
+        sprintf(tmp + l, "f%07d", i);
+        paths[i] = strdup(tmp);
+    }
+    numpaths = n;
+}
+
+/* make room in the image */
+unsigned char *grow(UINT64 size)
+{
+    unsigned char *ret;
+    if(imgpos + size > imgsize) {
+        imgsize = (imgpos + size) * 2;
+        img = realloc(img, imgsize);
+    }
+    ret = img + imgpos;
+    memset(ret, 0, size);
+    imgpos += size;
+    return ret;
+}
+
+/* copy the image to a page aligned buffer with some zeros after, like the loader has it */
+unsigned char *finish(void)
+{
+    unsigned char *ret = aligned_alloc(4096, ((imgpos + 4095) & ~4095) + 4096);
+    memset(ret, 0, ((imgpos + 4095) & ~4095) + 4096);
+    memcpy(ret, img, imgpos);
+    return ret;
+}
+
+/* cpio hpodc, newc and crc */
+unsigned char *mkcpio(int fmt)
+{
+    int i, ns, fs;
+    unsigned char *p;
+    for(i = 0; i <= numpaths; i++) {
+        char *name = i < numpaths ? paths[i] : "TRAILER!!!";
+        ns = strlen(name) + 1; fs = i < numpaths ? datalen(i) : 0;
+        if(fmt == 7) {
+            p = grow(76 + ns + fs);
+            sprintf((char*)p, "070707%06o%06o%06o%06o%06o%06o%06o%011o%06o%011o", 0, i + 1, 0100644, 0, 0, 1, 0, 0, ns, fs);
+            memcpy(p + 76, name, ns);
+            if(fs) putdata(p + 76 + ns, i);
+        } else {
+            p = grow(((110 + ns + 3) & ~3) + ((fs + 3) & ~3));
+            sprintf((char*)p, "07070%d%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X", fmt,
+                i + 1, 0100644, 0, 0, 1, 0, fs, 0, 0, 0, 0, ns, 0);
+            memcpy(p + 110, name, ns);
+            if(fs) putdata(p + ((110 + ns + 3) & ~3), i);
+        }
+    }
+    return finish();
+}
+
+/* ustar */
+unsigned char *mktar(void)
+{
+    int i, fs;
+    unsigned char *p;
+    for(i = 0; i < numpaths; i++) {
+        fs = datalen(i);
+        p = grow(512 + ((fs + 511) & ~511));
+        strcpy((char*)p, paths[i]);
+        sprintf((char*)p + 100, "%07o", 0644);
+        sprintf((char*)p + 124, "%011o", fs);
+        p[156] = '0';
+        memcpy(p + 257, "ustar", 6);
+        memcpy(p + 263, "00", 2);
+        putdata(p + 512, i);
+    }
+    grow(1024);
+    return finish();
+}
+
+/* Simple File System, 1.0 (ver 0) and 1.10 (ver 10), 512 byte blocks */
+unsigned char *mksfs(int ver)
+{
+    int i, fs;
+    UINT64 blk, idx;
+    unsigned char *p, *sb;
+    grow(512);
+    /* data area, one or more blocks per file */
+    for(i = 0; i < numpaths; i++)
+        putdata(grow((datalen(i) + 511) & ~511), i);
+    /* index area at the end of the image, starting marker, files, volume identifier */
+    idx = (numpaths + 2) * 64;
+    grow(((imgpos + idx + 511) & ~511) - imgpos - idx);
+    p = grow(idx);
+    p[0] = 2;
+    for(i = 0, blk = 1; i < numpaths; i++) {
+        p += 64;
+        fs = datalen(i);
+        p[0] = 0x12;
+        memcpy(p + (ver ? 0x0B : 0x0A), &blk, 8);
+        memcpy(p + (ver ? 0x1B : 0x1A), &(UINT64){ fs }, 8);
+        strcpy((char*)p + (ver ? 0x23 : 0x22), paths[i]);
+        blk += (fs + 511) / 512;
+    }
+    p[64] = 1;
+    /* super block */
+    sb = img + (ver ? 0x18E : 0x194);
+    memcpy(sb + 0x10, &idx, 8);
+    memcpy(sb + 0x18, ver ? "SFS\x1A" : "SFS\x10", 4);
+    memcpy(sb + 0x1C, &(UINT64){ imgpos / 512 }, 8);
+    sb[0x28] = 2;
+    return finish();
+}
+
+/* James Molloy's initrd */
+unsigned char *mkjamesm(void)
+{
+    int i;
+    UINT32 offs, fs;
+    unsigned char *p;
+    p = grow(4 + numpaths * 73);
+    *((UINT32*)p) = numpaths;
+    for(i = 0, offs = 4 + numpaths * 73; i < numpaths; i++, offs += fs) {
+        fs = datalen(i);
+        p[4 + i * 73] = 0xBF;
+        strcpy((char*)p + 4 + i * 73 + 1, paths[i]);
+        memcpy(p + 4 + i * 73 + 65, &offs, 4);
+        memcpy(p + 4 + i * 73 + 69, &fs, 4);
+    }
+    for(i = 0; i < numpaths; i++)
+        putdata(grow(datalen(i)), i);
+    return finish();
+}
+
+/* BOOTBOOT native image, or seekable gzip compressed one, written by mkinitrd */
+unsigned char *mkbbfs(int seek)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    int i;
+    ent = realloc(ent, numpaths * sizeof(entry_t));
+    for(i = 0; i < numpaths; i++) {
+        memset(&ent[i], 0, sizeof(entry_t));
+        ent[i].name = paths[i];
+        ent[i].size = datalen(i);
+        ent[i].data = malloc(ent[i].size);
+        putdata(ent[i].data, i);
+        ent[i].hash = mkinitrd_hash((unsigned char*)paths[i], strlen(paths[i]));
+    }
+    nent = numpaths; seekable = seek;
+    f = open_memstream(&buf, &len);
+    if(f == NULL || write_image(f)) { fprintf(stderr, "benchfs: mkinitrd failed\n"); exit(2); }
+    fclose(f);
+    memcpy(grow(len), buf, len);
+    free(buf);
+    for(i = 0; i < numpaths; i++) free(ent[i].data);
+    return finish();
+}
+
+/* directory tree of the paths, directory names end in a slash */
+typedef struct node {
+    char *name;
+    int file, num, max;
+    struct node **kids;
+} node_t;
+
+node_t *addnode(node_t *dir, char *name, int len, int file)
+{
+    int i;
+    for(i = 0; i < dir->num; i++)
+        if(!strncmp(dir->kids[i]->name, name, len) && !dir->kids[i]->name[len])
+            return dir->kids[i];
+    if(dir->num == dir->max) {
+        dir->max = dir->max * 2 + 16;
+        dir->kids = realloc(dir->kids, dir->max * sizeof(node_t*));
+    }
+    dir->kids[dir->num] = calloc(1, sizeof(node_t));
+    dir->kids[dir->num]->name = strndup(name, len);
+    dir->kids[dir->num]->file = file;
+    return dir->kids[dir->num++];
+}
+
+void freenode(node_t *node)
+{
+    int i;
+    for(i = 0; i < node->num; i++)
+        freenode(node->kids[i]);
+    free(node->kids); free(node->name); free(node);
+}
+
+node_t *mktree(void)
+{
+    node_t *root = calloc(1, sizeof(node_t)), *dir;
+    char *s, *e;
+    int i;
+    root->file = -1;
+    for(i = 0; i < numpaths; i++) {
+        for(dir = root, s = paths[i]; (e = strchr(s, '/')); s = e + 1)
+            dir = addnode(dir, s, e - s + 1, -1);
+        addnode(dir, s, strlen(s), i);
+    }
+    return root;
+}
+
+/* SquashFS 4.0, 4k blocks, gzip compressed. The files are smaller than a
+ * block, so their data is packed in fragment blocks */
+typedef struct {
+    unsigned char raw[SQFS_METASIZE], *out;
+    UINT32 rawlen, outlen, outmax;
+} sqmeta_t;
+sqmeta_t sqinodes, sqdirs, sqfrags;
+unsigned char sqfrag[4096];
+UINT32 sqfraglen, sqnumfrags, sqnumino;
+
+/* compress a block to dst with zlib, returns 0 if it didn't get smaller */
+UINT32 sqpack(unsigned char *dst, unsigned char *src, UINT32 len)
+{
+    uLongf n = len - 1;
+    return compress2(dst, &n, src, len, 9) == Z_OK ? n : 0;
+}
+
+/* close the current metadata block */
+void sqflush(sqmeta_t *m)
+{
+    UINT32 n;
+    if(!m->rawlen) return;
+    if(m->outlen + 2 + SQFS_METASIZE > m->outmax) {
+        m->outmax = (m->outmax + SQFS_METASIZE) * 2;
+        m->out = realloc(m->out, m->outmax);
+    }
+    if(!(n = sqpack(m->out + m->outlen + 2, m->raw, m->rawlen))) {
+        memcpy(m->out + m->outlen + 2, m->raw, m->rawlen);
+        n = m->rawlen | 0x8000;
+    }
+    m->out[m->outlen] = n & 0xFF; m->out[m->outlen + 1] = n >> 8;
+    m->outlen += 2 + (n & 0x7FFF);
+    m->rawlen = 0;
+}
+
+/* add to a metadata table, returns the reference of the data added */
+UINT64 sqadd(sqmeta_t *m, void *data, UINT32 len)
+{
+    UINT64 ref;
+    UINT32 n;
+    if(m->rawlen == SQFS_METASIZE) sqflush(m);
+    ref = ((UINT64)m->outlen << 16) | m->rawlen;
+    while(len > 0) {
+        if(m->rawlen == SQFS_METASIZE) sqflush(m);
+        n = SQFS_METASIZE - m->rawlen < len ? SQFS_METASIZE - m->rawlen : len;
+        memcpy(m->raw + m->rawlen, data, n);
+        data = (unsigned char*)data + n; m->rawlen += n; len -= n;
+    }
+    return ref;
+}
+
+/* write out the fragment block and add it to the fragment table */
+void sqfragflush(void)
+{
+    struct { UINT64 start; UINT32 size, unused; } f = { imgpos, 0, 0 };
+    unsigned char tmp[4096];
+    if(!sqfraglen) return;
+    if((f.size = sqpack(tmp, sqfrag, sqfraglen)))
+        memcpy(grow(f.size), tmp, f.size);
+    else {
+        memcpy(grow(sqfraglen), sqfrag, sqfraglen);
+        f.size = sqfraglen | SQFS_UNCOMP;
+    }
+    sqadd(&sqfrags, &f, sizeof(f));
+    sqnumfrags++; sqfraglen = 0;
+}
+
+/* write a file or directory, returns its inode reference. Inode numbers are
+ * given in the order the inodes are written, *ino returns it */
+UINT64 sqwrite(node_t *node, UINT32 *ino)
+{
+    sqfs_inode_t in = { 0, 0644, 0, 0, 0, 0 };
+    sqfs_file_t fil;
+    sqfs_dir_t dir;
+    sqfs_ldir_t ldir;
+    sqfs_dirhdr_t dh;
+    sqfs_dirent_t de;
+    UINT64 *refs, start;
+    UINT32 *inos, size = 0, i, j;
+    if(node->file >= 0) {
+        if(sqfraglen + datalen(node->file) > sizeof(sqfrag)) sqfragflush();
+        fil.start = 0; fil.frag = sqnumfrags; fil.fragoffs = sqfraglen; fil.size = datalen(node->file);
+        putdata(sqfrag + sqfraglen, node->file);
+        sqfraglen += fil.size;
+        in.type = 2; in.ino = *ino = ++sqnumino;
+        start = sqadd(&sqinodes, &in, sizeof(in));
+        sqadd(&sqinodes, &fil, sizeof(fil));
+        return start;
+    }
+    refs = malloc(node->num * sizeof(UINT64));
+    inos = malloc(node->num * sizeof(UINT32));
+    for(i = 0; i < (UINT32)node->num; i++)
+        refs[i] = sqwrite(node->kids[i], &inos[i]);
+    /* listing, entries are grouped by the metadata block of their inodes */
+    if(sqdirs.rawlen == SQFS_METASIZE) sqflush(&sqdirs);
+    start = ((UINT64)sqdirs.outlen << 16) | sqdirs.rawlen;
+    for(i = 0; i < (UINT32)node->num; i += dh.count + 1) {
+        for(j = i; j < (UINT32)node->num && j - i < 256 && refs[j] >> 16 == refs[i] >> 16 &&
+            inos[j] - inos[i] < 32768; j++);
+        dh.count = j - i - 1; dh.start = refs[i] >> 16; dh.ino = inos[i];
+        sqadd(&sqdirs, &dh, sizeof(dh));
+        for(size += sizeof(dh); i < j; i++) {
+            de.offs = refs[i] & 0xFFFF; de.ino = inos[i] - dh.ino;
+            de.type = node->kids[i]->file >= 0 ? 2 : 1;
+            de.namelen = strlen(node->kids[i]->name) - (de.type == 1) - 1;
+            sqadd(&sqdirs, &de, sizeof(de));
+            sqadd(&sqdirs, node->kids[i]->name, de.namelen + 1);
+            size += sizeof(de) + de.namelen + 1;
+        }
+        i -= dh.count + 1;
+    }
+    free(refs); free(inos);
+    in.mode = 0755; in.ino = *ino = ++sqnumino;
+    if(size + 3 > 0xFFFF) {
+        in.type = 8;
+        ldir.nlink = 2; ldir.size = size + 3; ldir.start = start >> 16; ldir.parent = 0;
+        ldir.icount = 0; ldir.offs = start & 0xFFFF; ldir.xattr = SQFS_NOFRAG;
+        start = sqadd(&sqinodes, &in, sizeof(in));
+        sqadd(&sqinodes, &ldir, sizeof(ldir));
+    } else {
+        in.type = 1;
+        dir.start = start >> 16; dir.nlink = 2; dir.size = size + 3; dir.offs = start & 0xFFFF; dir.parent = 0;
+        start = sqadd(&sqinodes, &in, sizeof(in));
+        sqadd(&sqinodes, &dir, sizeof(dir));
+    }
+    return start;
+}
+
+unsigned char *mksqfs(void)
+{
+    node_t *root = mktree();
+    sqfs_t sb;
+    UINT64 ptr;
+    UINT32 i, ino;
+    memset(&sb, 0, sizeof(sb));
+    grow(sizeof(sqfs_t));
+    sqinodes.rawlen = sqinodes.outlen = sqdirs.rawlen = sqdirs.outlen = sqfrags.rawlen = sqfrags.outlen = 0;
+    sqfraglen = sqnumfrags = sqnumino = 0;
+    sb.root = sqwrite(root, &ino);
+    sqfragflush();
+    freenode(root);
+    sqflush(&sqinodes); sqflush(&sqdirs);
+    sb.inodetable = imgpos; memcpy(grow(sqinodes.outlen), sqinodes.out, sqinodes.outlen);
+    sb.dirtable = imgpos; memcpy(grow(sqdirs.outlen), sqdirs.out, sqdirs.outlen);
+    /* fragment table, the fragment entries' metadata blocks, then pointers to them */
+    sqflush(&sqfrags);
+    ptr = imgpos; memcpy(grow(sqfrags.outlen), sqfrags.out, sqfrags.outlen);
+    sb.fragtable = imgpos;
+    for(i = 0; i < sqfrags.outlen; i += 2 + ((sqfrags.out[i] | (sqfrags.out[i + 1] << 8)) & 0x7FFF))
+        *((UINT64*)grow(8)) = ptr + i;
+    /* id table with uid/gid 0 */
+    ptr = imgpos; memcpy(grow(6), "\x04\x80\0\0\0\0", 6);
+    sb.idtable = imgpos; *((UINT64*)grow(8)) = ptr;
+    sb.magic = SQFS_MAGIC; sb.inodes = sqnumino; sb.blocksize = sizeof(sqfrag); sb.frags = sqnumfrags;
+    sb.comp = SQFS_GZIP; sb.blocklog = 12; sb.ids = 1; sb.vmaj = 4;
+    sb.used = imgpos; sb.xattrtable = sb.exporttable = ~0ULL;
+    memcpy(img, &sb, sizeof(sb));
+    return finish();
+}
+
+#ifdef _FS_Z_H_
+/* FS/Z, files are inlined, in a direct sector or behind a sector directory by
+ * turns, directories are written backwards so that their sectors are not
+ * contiguous. There's one big fragmented file with a hole too, see fszcheck() */
+#define FSZ_FRAGSECS 300
+
+UINT64 fszsec(void) { grow(FSZ_SECSIZE); return imgpos / FSZ_SECSIZE - 1; }
+
+/* point an inode to a list of data sectors, adding at least lvl sector directory levels */
+void fszmap(UINT64 in, UINT64 *secs, UINT64 num, UINT64 lvl)
+{
+    UINT64 n = FSZ_SECSIZE / sizeof(FSZ_SectorList), i, *up, l = 0;
+    while(num > 1 || l < lvl) {
+        up = malloc(((num + n - 1) / n) * sizeof(UINT64));
+        for(i = 0; i < num; i++) {
+            if(i % n == 0) up[i / n] = fszsec();
+            ((FSZ_SectorList*)(img + up[i / n] * FSZ_SECSIZE))[i % n].sec = secs[i];
+        }
+        if(l) free(secs);
+        secs = up; num = (num + n - 1) / n; l++;
+    }
+    ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->sec = secs[0];
+    ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->flags = l ? FSZ_IN_FLAG_SD + l - 1 : FSZ_IN_FLAG_DIRECT;
+    if(l) free(secs);
+}
+
+/* contents of the fragmented file */
+UINT8 fszbyte(UINT64 offs) { return offs / FSZ_SECSIZE == 5 ? 0 : (offs / FSZ_SECSIZE * 31 + offs) & 0xFF; }
+
+UINT64 fszwrite(node_t *node)
+{
+    UINT64 in = fszsec(), *fids, *secs, i, j, n;
+    unsigned char *dir;
+    memcpy(((FSZ_Inode*)(img + in * FSZ_SECSIZE))->magic, FSZ_IN_MAGIC, 4);
+    if(node->file >= 0) {
+        ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->size = datalen(node->file);
+        if(node->file % 3 == 0) {
+            ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->flags = FSZ_IN_FLAG_INLINE;
+            putdata(((FSZ_Inode*)(img + in * FSZ_SECSIZE))->inlinedata, node->file);
+        } else {
+            i = fszsec();
+            putdata(img + i * FSZ_SECSIZE, node->file);
+            fszmap(in, &i, 1, node->file % 3 - 1);
+        }
+        return in;
+    }
+    if(node->file == -2) {
+        /* sectors in reverse order, the 6th is a hole */
+        secs = malloc(FSZ_FRAGSECS * sizeof(UINT64));
+        for(i = FSZ_FRAGSECS; i-- > 0;) {
+            secs[i] = i == 5 ? 0 : fszsec();
+            for(j = 0; secs[i] && j < FSZ_SECSIZE; j++)
+                img[secs[i] * FSZ_SECSIZE + j] = fszbyte(i * FSZ_SECSIZE + j);
+        }
+        fszmap(in, secs, FSZ_FRAGSECS, 0);
+        ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->size = FSZ_FRAGSECS * FSZ_SECSIZE - 100;
+        free(secs);
+        return in;
+    }
+    fids = malloc(node->num * sizeof(UINT64));
+    for(i = 0; i < (UINT64)node->num; i++)
+        fids[i] = fszwrite(node->kids[i]);
+    n = ((node->num + 1) * sizeof(FSZ_DirEnt) + FSZ_SECSIZE - 1) / FSZ_SECSIZE;
+    dir = calloc(n, FSZ_SECSIZE);
+    memcpy(dir, FSZ_DIR_MAGIC, 4);
+    ((FSZ_DirEntHeader*)dir)->numentries = node->num;
+    for(i = 0; i < (UINT64)node->num; i++) {
+        ((FSZ_DirEnt*)dir)[i + 1].fid = fids[i];
+        strcpy((char*)((FSZ_DirEnt*)dir)[i + 1].name, node->kids[i]->name);
+    }
+    secs = malloc(n * sizeof(UINT64));
+    for(i = n; i-- > 0;) {
+        secs[i] = fszsec();
+        memcpy(img + secs[i] * FSZ_SECSIZE, dir + i * FSZ_SECSIZE, FSZ_SECSIZE);
+    }
+    fszmap(in, secs, n, 0);
+    ((FSZ_Inode*)(img + in * FSZ_SECSIZE))->size = n * FSZ_SECSIZE;
+    free(secs); free(dir); free(fids);
+    return in;
+}
+
+unsigned char *mkfsz(void)
+{
+    node_t *root = mktree();
+    FSZ_SuperBlock *sb;
+    int i;
+    addnode(root, "frag", 4, -2);
+    grow(FSZ_SECSIZE);
+    i = fszwrite(root);
+    sb = (FSZ_SuperBlock*)img;
+    memcpy(sb->magic, FSZ_MAGIC, 4);
+    sb->logsec = FSZ_SECSIZE == 2048 ? 0 : (FSZ_SECSIZE == 4096 ? 1 : 2);
+    sb->rootdirfid = i;
+    freenode(root);
+    return finish();
+}
+
+/* every file on smaller images, the fragmented file must be reported as such
+ * and read back right */
+int fszcheck(unsigned char *initrd)
+{
+    file_t f;
+    UINT8 *buf, tmp[256];
+    UINT64 i;
+    int ok;
+    for(i = 0; numpaths <= 10000 && i < (UINT64)numpaths; i++) {
+        f = fsz_initrd(initrd, paths[i]);
+        putdata(tmp, i);
+        if(f.ptr == NULL || f.size != (UINTN)datalen(i) || memcmp(f.ptr, tmp, f.size) || fszfrag != NULL) return 0;
+    }
+    f = fsz_initrd(initrd, "frag");
+    if(f.ptr == NULL || f.size != FSZ_FRAGSECS * FSZ_SECSIZE - 100 || fszfrag == NULL) return 0;
+    buf = malloc(f.size + 8);
+    memset(buf, 0xAA, f.size + 8);
+    fsz_read(initrd, fszfrag, buf + 3, 0, f.size);
+    for(i = 0, ok = buf[f.size + 3] == 0xAA; ok && i < f.size; i++)
+        if(buf[i + 3] != fszbyte(i)) ok = 0;
+    /* a partial read across the hole */
+    fsz_read(initrd, fszfrag, buf, 5 * FSZ_SECSIZE - 10, FSZ_SECSIZE + 20);
+    for(i = 0; ok && i < FSZ_SECSIZE + 20; i++)
+        if(buf[i] != fszbyte(5 * FSZ_SECSIZE - 10 + i)) ok = 0;
+    if(fsz_offset(initrd, fszfrag, 5 * FSZ_SECSIZE) != NULL) ok = 0;
+    free(buf);
+    return ok;
+}
+#endif
+
+/* time a lookup, best of ROUNDS, in nanoseconds per call */
+double timeit(file_t (*fn)(unsigned char*, char*), unsigned char *initrd, int i, int reps, int *ok)
+{
+    struct timespec t0, t1;
+    double t, best = 1e30;
+    unsigned char buf[256];
+    file_t f = { NULL, 0 };
+    int j, r;
+    for(r = 0; r < ROUNDS; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(j = 0; j < reps; j++) {
+            /* drivers that uncompress return an allocation */
+            release(f.ptr);
+            f = (*fn)(initrd, paths[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        t = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / reps;
+        if(t < best) best = t;
+    }
+    putdata(buf, i);
+    if(f.ptr == NULL || f.size != (UINTN)datalen(i) || memcmp(f.ptr, buf, f.size)) *ok = 0;
+    release(f.ptr);
+    return best;
+}
+
+/* lookups through the index, the initrd parameter is ignored after the first call */
+unsigned char *locate_initrd;
+file_t locate(unsigned char *initrd, char *name) { (void)initrd; return fs_locate(locate_initrd, name); }
+
+/* entry point */
+int main(int argc, char** argv)
+{
+    struct {
+        char *name;
+        file_t (*fn)(unsigned char*, char*);
+        int arg, max;
+    } fmts[] = {
+        { "cpio hpodc", cpio_initrd, 7, 0 }, { "cpio newc", cpio_initrd, 1, 0 }, { "cpio crc", cpio_initrd, 2, 0 },
+        { "ustar", tar_initrd, 0, 0 }, { "SFS 1.0", sfs_initrd, 0, 0 }, { "SFS 1.10", sfs_initrd, 10, 0 },
+        { "JamesM", jamesm_initrd, 0, 65535 }, { "BBFS", bbfs_initrd, 0, 10000 },
+        { "SquashFS", sqfs_initrd, 0, 0 }, { "GZIX", gzix_initrd, 1, 10000 },
+#ifdef _FS_Z_H_
+        { "FS/Z", fsz_initrd, 0, 0 },
+#endif
+        { NULL, NULL, 0, 0 }
+    };
+    struct timespec t0, t1;
+    unsigned char *initrd;
+    double lin[3], idx[3], build;
+    int i, j, n, depth = 2, reps, ok, fails = 0, which[3];
+
+    if(argc < 2) {
+        printf( "BOOTBOOT benchfs utility - bztsrc@github\n\nUsage:\n"
+                "  ./benchfs [-d depth] <entries> [entries...]\n\n"
+                "Generates initrd images in every supported format with the given number of\n"
+                "files, each placed depth directories deep, and measures the lookup of the\n"
+                "first, middle and last file with the driver and with the index.\n"
+                "Examples:\n"
+                "  ./benchfs 10 1000 100000     - three image sizes, 2 levels deep\n"
+                "  ./benchfs -d 0 5000          - 5000 files in the root directory\n");
+        return 1;
+    }
+    printf("%-10s %7s %5s | %-29s | %9s | %-26s | %s\n", "format", "files", "depth",
+        "   driver lookup (us)", "index", "  indexed lookup (ns)", "result");
+    printf("%-10s %7s %5s | %9s %9s %9s | %9s | %8s %8s %8s |\n", "", "", "",
+        "first", "middle", "last", "build(ms)", "first", "middle", "last");
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-d") && i + 1 < argc) { depth = atoi(argv[++i]); continue; }
+        n = atoi(argv[i]);
+        if(n < 2) { fprintf(stderr, "benchfs: at least 2 entries needed\n"); fails++; continue; }
+        mkpaths(n, depth);
+        which[0] = 0; which[1] = n / 2; which[2] = n - 1;
+        for(j = 0; fmts[j].name; j++) {
+            if(fmts[j].max && n > fmts[j].max) {
+                printf("%-10s %7d %5d | %-29s | %9s | %-26s | skipped\n", fmts[j].name, n, depth, "", "", "");
+                continue;
+            }
+            imgpos = 0;
+            if(fmts[j].fn == cpio_initrd) initrd = mkcpio(fmts[j].arg);
+            else if(fmts[j].fn == tar_initrd) initrd = mktar();
+            else if(fmts[j].fn == sfs_initrd) initrd = mksfs(fmts[j].arg);
+            else if(fmts[j].fn == jamesm_initrd) initrd = mkjamesm();
+            else if(fmts[j].fn == bbfs_initrd || fmts[j].fn == gzix_initrd) initrd = mkbbfs(fmts[j].arg);
+            else if(fmts[j].fn == sqfs_initrd) initrd = mksqfs();
+#ifdef _FS_Z_H_
+            else initrd = mkfsz();
+#else
+            else continue;
+#endif
+            ok = 1;
+            /* linear scans, fewer repetitions on bigger images */
+            reps = n < 100000 ? 100000 / n : 1;
+            /* a seekable gzip lookup inflates a chunk or more */
+            if(fmts[j].fn == gzix_initrd) reps = 1;
+            lin[0] = timeit(fmts[j].fn, initrd, which[0], reps, &ok);
+            lin[1] = timeit(fmts[j].fn, initrd, which[1], reps, &ok);
+            lin[2] = timeit(fmts[j].fn, initrd, which[2], reps, &ok);
+            /* first fs_locate call detects the format and builds the index */
+            fsindex_p = NULL; locate_initrd = initrd;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            release(fs_locate(initrd, paths[0]).ptr);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            build = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+            reps = fsnum ? 10000 : (n < 100000 ? 100000 / n : 1);
+            if(fmts[j].fn == gzix_initrd) reps = 1;
+            idx[0] = timeit(locate, initrd, which[0], reps, &ok);
+            idx[1] = timeit(locate, initrd, which[1], reps, &ok);
+            idx[2] = timeit(locate, initrd, which[2], reps, &ok);
+#ifdef _FS_Z_H_
+            if(fmts[j].fn == fsz_initrd && !fszcheck(initrd)) ok = 0;
+#endif
+            if(!ok) fails++;
+            printf("%-10s %7d %5d | %9.2f %9.2f %9.2f | %9.2f | %8.0f %8.0f %8.0f | %s%s\n", fmts[j].name, n, depth,
+                lin[0] / 1e3, lin[1] / 1e3, lin[2] / 1e3, build, idx[0], idx[1], idx[2],
+                ok ? "OK" : "FAIL", fsnum ? "" : " (not indexed)");
+            fsindex_p = NULL;
+            free(initrd);
+        }
+        for(j = 0; j < n; j++) free(paths[j]);
+        free(paths);
+    }
+    free(img);
+    return fails ? 2 : 0;
+}
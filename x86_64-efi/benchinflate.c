@@ -0,0 +1,326 @@
+/*
+ * x86_64-efi/benchinflate.c
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Hosted benchmark and conformance test for tinflate.c
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+#include "tinf.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0
+#endif
+
+/* how many times each image is inflated */
+#define ROUNDS 5
+/* the loader reads the initrd in chunks of this size, see INITRD_CHUNK */
+#define CHUNK (1024*1024)
+/* most members in an image */
+#define MAXMEMBERS 256
+
+/* load a file into memory */
+unsigned char *readfile(char *name, unsigned long *size)
+{
+    FILE *f;
+    unsigned char *buf = NULL;
+
+    f = fopen(name, "rb");
+    if(!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(*size + 1);
+    if(buf && fread(buf, 1, *size, f) != *size) { free(buf); buf = NULL; }
+    fclose(f);
+    return buf;
+}
+
+/* generate an image of size bytes that looks like an initrd: text, code, zero
+ * filled and random (incompressible) pages, so that all block types show up */
+unsigned char *genfile(unsigned long size)
+{
+    static const char *words[] = { "the ", "initrd ", "kernel ", "static ", "int ", "return ", "0x00, ",
+        "struct ", "#include ", "void ", "\n", "    ", "if(", ") {\n", "}\n", "uint64_t ", "NULL", ";\n" };
+    unsigned char *buf = malloc(size + 1), *p, *end;
+    uint64_t x = 88172645463325252ULL, i;
+
+#define RND() (x ^= x << 13, x ^= x >> 7, x ^= x << 17)
+    if(!buf) return NULL;
+    for(p = buf; p < buf + size; p = end) {
+        end = p + 4096 > buf + size ? buf + size : p + 4096;
+        switch(RND() % 20) {
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+                while(p < end) {
+                    const char *w = words[RND() % (sizeof(words)/sizeof(words[0]))];
+                    while(*w && p < end) *p++ = *w++;
+                }
+            break;
+            case 8: case 9: case 10: case 11: case 12:
+                /* code like, a few opcodes with small operands */
+                while(p < end) { i = RND(); *p++ = "\x48\x89\x8b\xe8\x0f\xc3\x00\xff"[i & 7]; if(p < end) *p++ = (i >> 8) & 15; }
+            break;
+            case 13: case 14: case 15:
+                memset(p, 0, end - p);
+            break;
+            default:
+                while(p < end) *p++ = RND() >> 24;
+            break;
+        }
+    }
+#undef RND
+    return buf;
+}
+
+/* gzip compress an uncompressed image with zlib, like "gzip -9" would. With more
+ * than one member the image is cut into that many parts, each compressed on its
+ * own and concatenated, like pigz --independent or "cat a.gz b.gz" would */
+unsigned char *gzipfile(unsigned char *data, unsigned long size, int members, unsigned long *gzsize)
+{
+    z_stream s;
+    unsigned char *buf;
+    unsigned long bound, a, b;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    if(deflateInit2(&s, 9, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    bound = deflateBound(&s, size) + members * 64;
+    buf = malloc(bound);
+    if(!buf) { deflateEnd(&s); return NULL; }
+    *gzsize = 0;
+    for(i = 0; i < members; i++) {
+        a = size * i / members; b = size * (i + 1) / members;
+        deflateReset(&s);
+        s.next_in = data + a; s.avail_in = b - a;
+        s.next_out = buf + *gzsize; s.avail_out = bound - *gzsize;
+        if(deflate(&s, Z_FINISH) != Z_STREAM_END) { free(buf); buf = NULL; break; }
+        *gzsize += s.total_out;
+    }
+    deflateEnd(&s);
+    return buf;
+}
+
+/* skip a gzip header, returns pointer to the deflate stream */
+unsigned char *gzipdata(unsigned char *ptr)
+{
+    unsigned char f;
+
+    if(ptr[0]!=0x1f || ptr[1]!=0x8b || ptr[2]!=8) return NULL;
+    f = ptr[3]; ptr += 10;
+    if(f & 4) ptr += 2 + (ptr[0] | (ptr[1] << 8));
+    if(f & 8) while(*ptr++);
+    if(f & 16) while(*ptr++);
+    if(f & 2) ptr += 2;
+    return ptr;
+}
+
+/* inflate all members with zlib. Returns the number of members and their offsets
+ * (with the end of the image after the last one), the output's size and crc32 */
+int zmembers(unsigned char *gz, unsigned long gzsize, unsigned long *offs, uint64_t *size, uint32_t *crc)
+{
+    z_stream s;
+    unsigned char *buf = malloc(CHUNK);
+    int n = 0, r;
+
+    memset(&s, 0, sizeof(s));
+    if(!buf || inflateInit2(&s, 31) != Z_OK) { free(buf); return 0; }
+    s.next_in = gz; s.avail_in = gzsize;
+    *size = 0; *crc = 0;
+    while(s.avail_in && n < MAXMEMBERS) {
+        offs[n++] = gzsize - s.avail_in;
+        inflateReset(&s);
+        do {
+            s.next_out = buf; s.avail_out = CHUNK;
+            r = inflate(&s, Z_NO_FLUSH);
+            *crc = crc32(*crc, buf, CHUNK - s.avail_out);
+            *size += CHUNK - s.avail_out;
+        } while(r == Z_OK);
+        if(r != Z_STREAM_END) { n = 0; break; }
+    }
+    if(s.avail_in) n = 0;
+    offs[n] = gzsize;
+    inflateEnd(&s);
+    free(buf);
+    return n;
+}
+
+/* chunked source, a stand-in for the loader's file reads into a double buffer */
+unsigned char *src_ptr, *src_end, *src_buf[2];
+int src_next;
+unsigned long src_chunk;
+
+/* readSource callback, copies the next chunk like a file read would, see ChunkSource */
+unsigned char chunksource(TINF_DATA *d)
+{
+    unsigned long n = src_end - src_ptr < (long)src_chunk ? (unsigned long)(src_end - src_ptr) : src_chunk;
+
+    if(!n) {
+        d->source = d->source_limit;
+        d->overrun++;
+        return 0;
+    }
+    memcpy(src_buf[src_next], src_ptr, n);
+    src_ptr += n;
+    d->source = src_buf[src_next];
+    d->source_limit = d->source + n;
+    src_next ^= 1;
+    return *d->source++;
+}
+
+/* inflate every member with tinflate, from the whole image in memory or through the
+ * chunked source. Returns non-zero if all members and their checksums are correct */
+int tinfall(unsigned char *gz, unsigned long *offs, int num, unsigned char *out, int stream)
+{
+    TINF_DATA d;
+    unsigned char *dst = out, *data, *end;
+    uint32_t isize, crc;
+    int i, r;
+
+    for(i = 0; i < num; i++) {
+        end = gz + offs[i + 1] - 8;
+        memcpy(&crc, end, 4);
+        memcpy(&isize, end + 4, 4);
+        data = gzipdata(gz + offs[i]);
+        if(!data || data > end) return 0;
+        uzlib_uncompress_init(&d, NULL, 0);
+        if(stream) {
+            /* the first chunk is read from the member's header on */
+            src_ptr = data; src_end = end; src_next = 0;
+            d.source = d.source_limit = src_buf[1];
+            d.readSource = chunksource;
+        } else {
+            d.source = data;
+            d.source_limit = end;
+        }
+        d.checksum_type = TINF_CHKSUM_CRC;
+        d.checksum = ~0;
+        r = uzlib_uncompress_buf(&d, dst, isize);
+        if(r != TINF_DONE || d.dest != dst + isize || ~d.checksum != crc) return 0;
+        dst += isize;
+    }
+    return 1;
+}
+
+/* entry point */
+int main(int argc, char** argv)
+{
+    unsigned char *data, *gz, *out;
+    unsigned long size, gzsize, offs[MAXMEMBERS + 1], c, best_c;
+    uint64_t isize;
+    uint32_t zcrc;
+    double t, best_t[2], total_mb = 0, total_t[2] = { 0, 0 };
+    struct timespec t0, t1;
+    int i, j, k, r, num, members = 1, fails = 0;
+    char name[32], *fn;
+
+    if(argc < 2) {
+        printf( "BOOTBOOT benchinflate utility - bztsrc@github\n\nUsage:\n"
+                "  ./benchinflate [-m members] [-c chunk] <image|-g MB> [image|-g MB...]\n\n"
+                "Inflates initrd images with tinflate.c and checks the output against zlib, from\n"
+                "the whole image in memory (MB/s) and through a readSource callback that gets\n"
+                "the image in chunks like the loader does (stream MB/s).\n"
+                "Images that aren't gzip compressed are compressed with zlib first, cut into\n"
+                "the given number of members (default 1). -g generates an image of MB megabytes,\n"
+                "-c sets the streaming chunk size (default %d).\n"
+                "Examples:\n"
+                "  ./benchinflate INITRD            - a gzip compressed initrd\n"
+                "  ./benchinflate initrd.cpio fs.sfs - uncompressed images\n"
+                "  ./benchinflate -m 8 -g 1 -g 64   - generated images with 8 members\n", CHUNK);
+        return 1;
+    }
+    uzlib_init();
+    src_chunk = CHUNK;
+    for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != 'g'; i += 2) {
+        if(i + 1 >= argc) { fprintf(stderr, "benchinflate: %s needs a value\n", argv[i]); return 1; }
+        if(argv[i][1] == 'm') members = atoi(argv[i + 1]);
+        else if(argv[i][1] == 'c') src_chunk = atol(argv[i + 1]);
+        else { fprintf(stderr, "benchinflate: unknown option %s\n", argv[i]); return 1; }
+    }
+    if(members < 1 || members > MAXMEMBERS || src_chunk < 1) { fprintf(stderr, "benchinflate: bad option value\n"); return 1; }
+    src_buf[0] = malloc(src_chunk); src_buf[1] = malloc(src_chunk);
+    printf("%-32s %10s %10s %4s %9s %9s %9s %8s  %s\n", "image", "size", "gzipped", "mbrs", "MB/s", "stream", "cyc/byte",
+        "crc32", "result");
+    for(; i < argc; i++) {
+        if(!strcmp(argv[i], "-g") && i + 1 < argc) {
+            size = atol(argv[++i]) * 1024 * 1024;
+            snprintf(name, sizeof(name), "generated %luM", size >> 20);
+            fn = name;
+            data = genfile(size);
+        } else {
+            fn = argv[i];
+            data = readfile(fn, &size);
+        }
+        if(!data) { fprintf(stderr, "benchinflate: unable to read %s\n", fn); fails++; continue; }
+        if(size > 18 && data[0] == 0x1f && data[1] == 0x8b) {
+            gz = data; gzsize = size;
+        } else {
+            gz = gzipfile(data, size, members, &gzsize);
+            free(data);
+            if(!gz) { fprintf(stderr, "benchinflate: unable to compress %s\n", fn); fails++; continue; }
+        }
+        /* reference output size and checksum by zlib */
+        num = zmembers(gz, gzsize, offs, &isize, &zcrc);
+        out = num ? malloc(isize + 1) : NULL;
+        /* best of a few rounds, from memory and streamed */
+        r = out != NULL; best_c = ~0UL;
+        for(k = 0; k < 2; k++) {
+            best_t[k] = 1e9;
+            for(j = 0; r && j < ROUNDS; j++) {
+                memset(out, 0, isize);
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                c = cycles();
+                r = tinfall(gz, offs, num, out, k);
+                c = cycles() - c;
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+                if(t < best_t[k]) best_t[k] = t;
+                if(!k && c < best_c) best_c = c;
+                r = r && crc32(0, out, isize) == zcrc;
+            }
+        }
+        if(!r) fails++;
+        printf("%-32s %10lu %10lu %4d %9.1f %9.1f %9.2f %08x  %s\n", fn, (unsigned long)isize, gzsize, num,
+            isize / best_t[0] / 1048576.0, isize / best_t[1] / 1048576.0, isize ? (double)best_c / isize : 0.0,
+            zcrc, r ? "OK" : "FAIL");
+        if(r) {
+            total_mb += isize / 1048576.0; total_t[0] += best_t[0]; total_t[1] += best_t[1];
+        }
+        free(gz); free(out);
+    }
+    if(total_t[0] > 0 && total_t[1] > 0)
+        printf("total %.1f MB, %.1f MB/s, streamed %.1f MB/s, %d failed\n", total_mb, total_mb / total_t[0],
+            total_mb / total_t[1], fails);
+    else if(fails)
+        printf("%d failed\n", fails);
+    free(src_buf[0]); free(src_buf[1]);
+    return fails ? 2 : 0;
+}
@@ -47,6 +47,8 @@
 // get BOOTBOOT specific stuff
 #include "../bootboot.h"
 #include "tinf.h"
+#include "lz4.h"
+#include "zstd.h"
 // comment out this include if you don't want FS/Z support
 #include "../../osZ/etc/include/fsZ.h"
 // get filesystem drivers for initrd
@@ -179,6 +181,49 @@ typedef struct {
 } EFI_PCI_OPTION_ROM_TABLE;
 #endif
 
+/* neither the MP services protocol */
+#ifndef EFI_MP_SERVICES_PROTOCOL_GUID
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+  { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+struct _EFI_MP_SERVICES_PROTOCOL;
+
+typedef
+VOID
+(EFIAPI *EFI_AP_PROCEDURE)(
+  IN VOID                                     *Buffer
+  );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS)(
+  IN struct _EFI_MP_SERVICES_PROTOCOL         *This,
+  OUT UINTN                                   *NumberOfProcessors,
+  OUT UINTN                                   *NumberOfEnabledProcessors
+  );
+
+typedef
+EFI_STATUS
+(EFIAPI *EFI_MP_SERVICES_STARTUP_ALL_APS)(
+  IN struct _EFI_MP_SERVICES_PROTOCOL         *This,
+  IN EFI_AP_PROCEDURE                         Procedure,
+  IN BOOLEAN                                  SingleThread,
+  IN EFI_EVENT                                WaitEvent OPTIONAL,
+  IN UINTN                                    TimeoutInMicroSeconds,
+  IN VOID                                     *ProcedureArgument OPTIONAL,
+  OUT UINTN                                   **FailedCpuList OPTIONAL
+  );
+
+typedef struct _EFI_MP_SERVICES_PROTOCOL {
+  EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS    GetNumberOfProcessors;
+  VOID                                        *GetProcessorInfo;
+  EFI_MP_SERVICES_STARTUP_ALL_APS             StartupAllAPs;
+  VOID                                        *StartupThisAP;
+  VOID                                        *SwitchBSP;
+  VOID                                        *EnableDisableAP;
+  VOID                                        *WhoAmI;
+} EFI_MP_SERVICES_PROTOCOL;
+#endif
+
 /*** other defines and structs ***/
 typedef struct {
     UINT8 magic[8];
@@ -197,6 +242,10 @@ typedef struct {
 file_t env;         // environment file descriptor
 file_t initrd;      // initrd file descriptor
 file_t core;        // kernel file descriptor
+file_t fidx;        // initrd file table for the kernel
+UINT8 *coretail;    // core pages that are not mapped from the initrd
+#define COREPAGES 509   // pages between the environment and the stack at -2M
+UINT8 *coremap[COREPAGES]; // physical address of each core page
 BOOTBOOT *bootboot; // the BOOTBOOT structure
 UINT64 *paging;     // paging table for MMU
 UINT64 entrypoint;  // kernel entry point
@@ -212,6 +261,29 @@ char *kernelname="sys/core";
 // alternative environment name
 char *cfgname="sys/config";
 
+// streaming initrd load, the next chunk is read while the previous one is inflated
+#define INITRD_CHUNK (1024*1024)
+// free space needed after an in place uncompressed image, so that the output never
+// catches up with the compressed input at the buffer's tail
+#define INPLACE_MARGIN(l) (((l)>>8)+ZSTD_BLOCK_MAX+PAGESIZE)
+#ifndef EFI_FILE_PROTOCOL_REVISION2
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+#endif
+EFI_FILE_HANDLE     chunkfile;      // file being streamed
+EFI_FILE_IO_TOKEN   chunktoken;     // asynchronous read request
+UINT8 *chunkbuf[2];                 // double buffer
+UINT64 chunkleft;                   // bytes not requested yet
+UINTN chunkpend;                    // size of the pending request
+int chunknext, chunkasync;
+
+// concatenated gzip members, inflated on all cores
+#define GZ_MAXMEMBERS 256
+#define GZ_MAXRATIO 1032                // best possible deflate compression ratio
+UINT8 *gzmember[GZ_MAXMEMBERS+1];   // member headers and the end of the last one
+UINT8 *gzdest[GZ_MAXMEMBERS];       // final position of each member's output
+INT32 gzstatus[GZ_MAXMEMBERS];      // 1 inflated, -1 error
+int gznum, gznext;
+
 /**
  * function to convert ascii to number
  */
@@ -500,26 +572,542 @@ LoadFile(IN CHAR16 *FileName, OUT UINT8 **FileData, OUT UINTN *FileDataLength)
     return EFI_SUCCESS;
 }
 
+/**
+ * Skip a gzip header, returns pointer to the deflate stream
+ */
+UINT8 *GzipData(UINT8 *ptr)
+{
+    UINT8 f;
+    if(ptr[0]!=0x1f || ptr[1]!=0x8b || ptr[2]!=8)
+        return NULL;
+    f=ptr[3]; ptr+=10;
+    if(f&4) { ptr+=ptr[0]+(ptr[1]<<8)+2; }
+    if(f&8) { while(*ptr++ != 0); }
+    if(f&16) { while(*ptr++ != 0); }
+    if(f&2) ptr+=2;
+    return ptr;
+}
+
+/**
+ * Find the next gzip member header from ptr on, start is the previous member's.
+ * This may give false positives in compressed data, so the trailer before a
+ * header must hold a size the previous member can inflate to
+ */
+UINT8 *GzipNextMember(UINT8 *start, UINT8 *ptr, UINT8 *end)
+{
+    for(;ptr+18<=end;ptr++)
+        if(ptr[0]==0x1f && ptr[1]==0x8b && ptr[2]==8 && !(ptr[3]&0xE0) &&
+            (ptr[8]==0 || ptr[8]==2 || ptr[8]==4) && (ptr[9]<=13 || ptr[9]==255) &&
+            (UINT64)*((UINT32*)(ptr-4))<=(UINT64)(ptr-start)*GZ_MAXRATIO)
+            return ptr;
+    return NULL;
+}
+
+/**
+ * Inflate one gzip member straight to its final position. Called on APs too,
+ * so it must not use boot services
+ */
+INT32 GzipMember(int i)
+{
+    TINF_DATA d;
+    UINT8 *end=gzmember[i+1]-8;
+    UINT32 len=*((UINT32*)(end+4));
+
+    d.source=GzipData(gzmember[i]);
+    if(d.source==NULL || d.source>=end)
+        return -1;
+    d.source_limit=end;
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.checksum_type = TINF_CHKSUM_CRC;
+    d.checksum = ~0;
+    if(uzlib_uncompress_buf(&d, gzdest[i], len)!=TINF_DONE || d.dest!=gzdest[i]+len ||
+        ~d.checksum!=*((UINT32*)end))
+        return -1;
+    return 1;
+}
+
+/**
+ * Take pending gzip members one by one until there's none left
+ */
+VOID EFIAPI
+GzipWorker(VOID *arg)
+{
+    int i;
+    (void)arg;
+    while((i=__sync_fetch_and_add(&gznext,1))<gznum)
+        gzstatus[i]=GzipMember(i);
+}
+
+/**
+ * Inflate concatenated gzip members (like "cat a.gz b.gz") in parallel on all
+ * cores. Returns the uncompressed buffer, or NULL if initrd is not such an
+ * image, in which case it should be inflated as a single member
+ */
+UINT8 *
+GzipParallel(UINT32 *size)
+{
+    EFI_STATUS status;
+    EFI_GUID mpGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    EFI_MP_SERVICES_PROTOCOL *mp = NULL;
+    EFI_EVENT event = NULL;
+    UINT8 *ptr, *end=initrd.ptr+initrd.size, *buf=NULL;
+    UINT64 len=0;
+    UINTN i, numcpu=1, numena=1;
+
+    // look for member headers. False positives will fail the crc check below
+    // and we fall back to a single member
+    gzmember[0]=initrd.ptr; gznum=1;
+    for(ptr=initrd.ptr+18;(ptr=GzipNextMember(gzmember[gznum-1],ptr,end))!=NULL;ptr+=18) {
+        if(gznum>=GZ_MAXMEMBERS)
+            return NULL;
+        gzmember[gznum++]=ptr;
+    }
+    if(gznum<2)
+        return NULL;
+    gzmember[gznum]=end;
+    for(i=0;i<(UINTN)gznum;i++)
+        len+=*((UINT32*)(gzmember[i+1]-4));
+    if(len==0 || len>=(UINT64)4*1024*1024*1024 || len>(UINT64)initrd.size*GZ_MAXRATIO)
+        return NULL;
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (len+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&buf);
+    if(buf==NULL)
+        return NULL;
+    for(ptr=buf,i=0;i<(UINTN)gznum;i++) {
+        gzdest[i]=ptr; gzstatus[i]=0;
+        ptr+=*((UINT32*)(gzmember[i+1]-4));
+    }
+    gznext=0;
+
+    // start the APs, then do our part of the job
+    status=uefi_call_wrapper(BS->LocateProtocol, 3, &mpGuid, NULL, (void**)&mp);
+    if(!EFI_ERROR(status) && mp!=NULL) {
+        uefi_call_wrapper(mp->GetNumberOfProcessors, 3, mp, &numcpu, &numena);
+        if(numena>1 && !EFI_ERROR(uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &event))) {
+            if(EFI_ERROR(uefi_call_wrapper(mp->StartupAllAPs, 7, mp, GzipWorker, FALSE, event, 0, NULL, NULL))) {
+                uefi_call_wrapper(BS->CloseEvent, 1, event);
+                event=NULL;
+            }
+        }
+    }
+    DBG(L" * Inflating %d gzip members on %d cores\n",gznum,event!=NULL?(int)numena:1);
+    GzipWorker(NULL);
+    if(event!=NULL) {
+        uefi_call_wrapper(BS->WaitForEvent, 3, 1, &event, &i);
+        uefi_call_wrapper(BS->CloseEvent, 1, event);
+    }
+
+    for(i=0;i<(UINTN)gznum;i++)
+        if(gzstatus[i]!=1) {
+            uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)buf, (len+PAGESIZE-1)/PAGESIZE);
+            return NULL;
+        }
+    *size=len;
+    return buf;
+}
+
+/**
+ * Wait for the pending chunk to arrive, returns the number of bytes read
+ */
+UINTN
+ChunkWait()
+{
+    UINTN size=chunkpend, idx;
+
+    if(!size)
+        return 0;
+    chunkpend=0;
+    if(chunkasync) {
+        uefi_call_wrapper(BS->WaitForEvent, 3, 1, &chunktoken.Event, &idx);
+        return EFI_ERROR(chunktoken.Status) ? 0 : chunktoken.BufferSize;
+    }
+    if(EFI_ERROR(uefi_call_wrapper(chunkfile->Read, 3, chunkfile, &size, chunkbuf[chunknext])))
+        return 0;
+    return size;
+}
+
+/**
+ * Request the next chunk into the spare buffer. If the firmware can't do
+ * asynchronous reads, it is read synchronously in ChunkWait instead
+ */
+VOID
+ChunkRequest()
+{
+    chunkpend = chunkleft < INITRD_CHUNK ? chunkleft : INITRD_CHUNK;
+    chunkleft -= chunkpend;
+    if(chunkpend && chunkasync) {
+        chunktoken.Status = EFI_SUCCESS;
+        chunktoken.BufferSize = chunkpend;
+        chunktoken.Buffer = chunkbuf[chunknext];
+        if(EFI_ERROR(uefi_call_wrapper(chunkfile->ReadEx, 2, chunkfile, &chunktoken))) {
+            uefi_call_wrapper(BS->CloseEvent, 1, chunktoken.Event);
+            chunkasync = 0;
+        }
+    }
+}
+
+/**
+ * Inflater's readSource callback, called when the current chunk is consumed.
+ * Past the end of the file or on a read error it feeds zeros, counted as overrun
+ */
+unsigned char
+ChunkSource(TINF_DATA *d)
+{
+    UINT8 *buf=chunkbuf[chunknext];
+    UINTN size=ChunkWait();
+
+    if(!size) {
+        d->source=d->source_limit;
+        d->overrun++;
+        return 0;
+    }
+    chunknext^=1;
+    ChunkRequest();
+    d->source=buf;
+    d->source_limit=buf+size;
+    return *d->source++;
+}
+
+/**
+ * Return the uncompressed size recorded in an LZ4 or Zstandard frame header,
+ * or 0 if it's not such a frame or the size isn't recorded
+ */
+UINT32
+FrameContentSize(UINT8 *ptr)
+{
+    UINT64 size=0;
+    UINTN fcslen, i;
+
+    if(ptr[0]==0x04 && ptr[1]==0x22 && ptr[2]==0x4D && ptr[3]==0x18) {
+        // content size flag in FLG, the size follows FLG and BD
+        if(ptr[4]&8)
+            CopyMem(&size,ptr+6,8);
+    } else if(ptr[0]==0x28 && ptr[1]==0xB5 && ptr[2]==0x2F && ptr[3]==0xFD) {
+        // the size follows the descriptor, window and dictionary id
+        fcslen=ptr[4]>>6 ? 1<<(ptr[4]>>6) : (ptr[4]&0x20 ? 1 : 0);
+        ptr+=5+!(ptr[4]&0x20)+((1<<(ptr[4]&3))>>1);
+        for(i=0;i<fcslen;i++)
+            size|=(UINT64)ptr[i]<<(i*8);
+        if(fcslen==2)
+            size+=256;
+    }
+    return size<0x80000000 ? size : 0;
+}
+
+/**
+ * Load an LZ4 or Zstandard compressed initrd with a known uncompressed size
+ * into the tail of its final buffer and uncompress it towards the head, so
+ * there's no separate buffer for the compressed image
+ */
+EFI_STATUS
+LoadInplace(UINT64 FileSize, UINTN ReadSize, UINT32 Length, OUT UINT8 **FileData, OUT UINTN *FileDataLength)
+{
+    EFI_STATUS          status;
+    UINTN               Pages, Used, RestSize=FileSize-ReadSize;
+    UINT8               *Buffer=NULL, *Src;
+    ZSTD_WORK           *work=NULL;
+    int                 r;
+
+    Pages = (Length+INPLACE_MARGIN(Length)+PAGESIZE-1)/PAGESIZE;
+    if (Pages < (FileSize+PAGESIZE-1)/PAGESIZE)
+        Pages = (FileSize+PAGESIZE-1)/PAGESIZE;
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, Pages, (EFI_PHYSICAL_ADDRESS*)&Buffer);
+    if (Buffer == NULL)
+        return EFI_OUT_OF_RESOURCES;
+    // the first chunk is already read
+    Src = Buffer+Pages*PAGESIZE-FileSize;
+    CopyMem(Src, chunkbuf[0], ReadSize);
+    if (RestSize) {
+        status = uefi_call_wrapper(chunkfile->Read, 3, chunkfile, &RestSize, Src+ReadSize);
+        if (EFI_ERROR(status) || RestSize != FileSize-ReadSize)
+            goto err;
+    }
+    DBG(L" * Uncompressing initrd in place %d bytes\n",FileSize);
+    if (Src[0]==0x04) {
+        r = lz4_uncompress(Src, FileSize, Buffer, &Length) == LZ4_OK;
+    } else {
+        uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (sizeof(ZSTD_WORK)+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&work);
+        if (work == NULL)
+            goto err;
+        r = zstd_uncompress(Src, FileSize, Buffer, &Length, work) == ZSTD_OK;
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)work, (sizeof(ZSTD_WORK)+PAGESIZE-1)/PAGESIZE);
+    }
+    if (!r)
+        goto err;
+    // give back the margin
+    Used = (Length+PAGESIZE-1)/PAGESIZE;
+    if (Used < Pages)
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(Buffer+Used*PAGESIZE), Pages-Used);
+    *FileData = Buffer;
+    *FileDataLength = Length;
+    return EFI_SUCCESS;
+
+err:
+    uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)Buffer, Pages);
+    return EFI_LOAD_ERROR;
+}
+
+/**
+ * Load the rest of the file after the first chunk, which is kept
+ */
+EFI_STATUS
+LoadRest(UINT64 FileSize, UINTN ReadSize, OUT UINT8 **FileData, OUT UINTN *FileDataLength)
+{
+    EFI_STATUS          status;
+    UINTN               Pages=(FileSize+PAGESIZE-1)/PAGESIZE, RestSize=FileSize-ReadSize;
+    UINT8               *Buffer=NULL;
+
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, Pages, (EFI_PHYSICAL_ADDRESS*)&Buffer);
+    if (Buffer == NULL)
+        return EFI_OUT_OF_RESOURCES;
+    CopyMem(Buffer, chunkbuf[0], ReadSize);
+    if (RestSize) {
+        status = uefi_call_wrapper(chunkfile->Read, 3, chunkfile, &RestSize, Buffer+ReadSize);
+        if (EFI_ERROR(status)) {
+            uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)Buffer, Pages);
+            return status;
+        }
+    }
+    *FileData = Buffer;
+    *FileDataLength = ReadSize+RestSize;
+    return EFI_SUCCESS;
+}
+
+/**
+ * Load a gzip compressed initrd from FS0 and inflate it on the fly, so the
+ * compressed image is never fully resident. LZ4 and Zstandard images with
+ * a recorded size are uncompressed in place. Anything else, including images
+ * with several gzip members, are loaded as is, keeping the first chunk read
+ */
+EFI_STATUS
+LoadInitrd(IN CHAR16 *FileName, OUT UINT8 **FileData, OUT UINTN *FileDataLength)
+{
+    EFI_STATUS          status;
+    EFI_FILE_INFO       *FileInfo;
+    UINT64              FileSize;
+    UINTN               ReadSize;
+    UINTN               TrailerSize = 8;
+    UINT32              trailer[2];
+    UINT8               *Buffer=NULL;
+    UINT32              Length;
+    TINF_DATA           d;
+    int                 r;
+
+    if ((RootDir == NULL) || (FileName == NULL)) {
+        return report(EFI_NOT_FOUND,L"Empty Root or FileName\n");
+    }
+
+    status = uefi_call_wrapper(RootDir->Open, 5, RootDir, &chunkfile, FileName,
+        EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY | EFI_FILE_HIDDEN | EFI_FILE_SYSTEM);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    FileInfo = LibFileInfo(chunkfile);
+    if (FileInfo == NULL) {
+        uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+        return LoadFile(FileName, FileData, FileDataLength);
+    }
+    FileSize = FileInfo->FileSize;
+    if (FileSize > 16*1024*1024)
+        FileSize = 16*1024*1024;
+    FreePool(FileInfo);
+
+    // read the first chunk and the gzip trailer
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, 2*INITRD_CHUNK/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&chunkbuf[0]);
+    if (chunkbuf[0] == NULL) {
+        uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+        return LoadFile(FileName, FileData, FileDataLength);
+    }
+    chunkbuf[1] = chunkbuf[0] + INITRD_CHUNK;
+    ReadSize = FileSize < INITRD_CHUNK ? FileSize : INITRD_CHUNK;
+    status = uefi_call_wrapper(chunkfile->Read, 3, chunkfile, &ReadSize, chunkbuf[0]);
+    if (EFI_ERROR(status) || ReadSize != (FileSize < INITRD_CHUNK ? FileSize : INITRD_CHUNK))
+        goto loadfile;
+    // seekable images are kept compressed, and uncompressed ones are used as is
+    if (ReadSize < 18 || gzix_index(chunkbuf[0]) != NULL)
+        goto loadrest;
+    if (GzipData(chunkbuf[0]) == NULL) {
+        Length = FrameContentSize(chunkbuf[0]);
+        if (!Length)
+            goto loadrest;
+        status = LoadInplace(FileSize, ReadSize, Length, FileData, FileDataLength);
+        uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)chunkbuf[0], 2*INITRD_CHUNK/PAGESIZE);
+        // the compressed image may be overwritten, so load it again
+        if (EFI_ERROR(status))
+            return LoadFile(FileName, FileData, FileDataLength);
+        return EFI_SUCCESS;
+    }
+    if (FileSize > ReadSize) {
+        uefi_call_wrapper(chunkfile->SetPosition, 2, chunkfile, FileSize-8);
+        status = uefi_call_wrapper(chunkfile->Read, 3, chunkfile, &TrailerSize, trailer);
+        uefi_call_wrapper(chunkfile->SetPosition, 2, chunkfile, ReadSize);
+        if (EFI_ERROR(status))
+            goto loadfile;
+    } else
+        CopyMem(trailer, chunkbuf[0]+ReadSize-8, 8);
+    // several members (as pigz or cat makes) are inflated in parallel by the
+    // caller from the whole image. It's such an image if the last member's size
+    // is too small for all the compressed data, or a header follows in the first chunk
+    if ((UINT64)trailer[1]+trailer[1]/4096+4096 < FileSize ||
+        GzipNextMember(chunkbuf[0], chunkbuf[0]+18, chunkbuf[0]+ReadSize) != NULL)
+        goto loadrest;
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (trailer[1]+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&Buffer);
+    if (Buffer == NULL)
+        goto loadfile;
+    DBG(L" * Streaming gzip compressed initrd %d bytes\n",FileSize);
+
+    // inflate, the callback switches chunks and requests the next one
+    d.source = GzipData(chunkbuf[0]);
+    d.source_limit = chunkbuf[0]+ReadSize;
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.readSource = ChunkSource;
+    d.checksum_type = TINF_CHKSUM_CRC;
+    d.checksum = ~0;
+    chunkleft = FileSize-ReadSize;
+    chunknext = 1;
+    chunkasync = chunkfile->Revision >= EFI_FILE_PROTOCOL_REVISION2 &&
+        !EFI_ERROR(uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &chunktoken.Event));
+    ChunkRequest();
+    r = uzlib_uncompress_buf(&d, Buffer, trailer[1]);
+    // don't free the buffers under a pending read
+    ChunkWait();
+    if (chunkasync)
+        uefi_call_wrapper(BS->CloseEvent, 1, chunktoken.Event);
+    if (r != TINF_DONE || d.dest != Buffer+trailer[1] || ~d.checksum != trailer[0]) {
+        // a corrupted image, or several members that looked like one. The
+        // chunks are gone, so it's read again and left to the caller
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)Buffer, (trailer[1]+PAGESIZE-1)/PAGESIZE);
+        goto loadfile;
+    }
+    uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+    uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)chunkbuf[0], 2*INITRD_CHUNK/PAGESIZE);
+    *FileData = Buffer;
+    *FileDataLength = trailer[1];
+    return EFI_SUCCESS;
+
+loadrest:
+    status = LoadRest(FileSize, ReadSize, FileData, FileDataLength);
+    if (!EFI_ERROR(status)) {
+        uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)chunkbuf[0], 2*INITRD_CHUNK/PAGESIZE);
+        return EFI_SUCCESS;
+    }
+loadfile:
+    uefi_call_wrapper(chunkfile->Close, 1, chunkfile);
+    uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)chunkbuf[0], 2*INITRD_CHUNK/PAGESIZE);
+    return LoadFile(FileName, FileData, FileDataLength);
+}
+
+/**
+ * Read a partition holding the initrd. Only the part its file system uses is
+ * read, the pages after that are freed. Unknown contents are read as a whole
+ */
+EFI_STATUS
+ReadPartition(EFI_BLOCK_IO *bio, UINT64 lba, UINT8 *Buffer, IN OUT UINTN *Length)
+{
+    EFI_STATUS  status;
+    UINT64      bs=bio->Media->BlockSize, used, head, tail, have, n;
+
+    have = *Length < FS_HEADSIZE ? *Length : FS_HEADSIZE;
+    status = bio->ReadBlocks(bio, bio->Media->MediaId, lba, have, Buffer);
+    // keep reading until the file system can tell its size
+    while(status==EFI_SUCCESS && have<*Length && (used=fs_used(Buffer,have,&head,&tail))!=0 &&
+        used<=*Length && head>have) {
+        n=(((head>2*have?head:2*have)+PAGESIZE-1)/PAGESIZE)*PAGESIZE;
+        if(n>*Length) n=*Length;
+        status = bio->ReadBlocks(bio, bio->Media->MediaId, lba+have/bs, n-have, Buffer+have);
+        have=n;
+    }
+    if(EFI_ERROR(status))
+        return status;
+    used=fs_used(Buffer,have,&head,&tail);
+    if(used==0 || used>*Length || head>have) {
+        used=*Length;
+        tail=have;
+    }
+    // whatever's between the head and the tail is not used
+    tail=(tail/bs)*bs;
+    if(tail<have) tail=have;
+    if(used>tail)
+        status = bio->ReadBlocks(bio, bio->Media->MediaId, lba+tail/bs, ((used-tail+bs-1)/bs)*bs, Buffer+tail);
+    used=((used+PAGESIZE-1)/PAGESIZE)*PAGESIZE;
+    DBG(L" * Partition %d of %d bytes used\n",used,*Length);
+    if(used<*Length)
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(Buffer+used), (*Length-used)/PAGESIZE);
+    *Length=used;
+    return status;
+}
+
+/**
+ * find the next possible start of an executable, checks 8 bytes at a time
+ * for the first byte of the ELF, OS/Z and MZ magics
+ */
+#define HASZERO(v) (((v)-0x0101010101010101UL)&~(v)&0x8080808080808080UL)
+#define HASBYTE(v,b) HASZERO((v)^(0x0101010101010101UL*(b)))
+#define ISMAGIC(c) ((c)==0x7F || (c)=='O' || (c)=='M')
+UINT8 *NextExecutable(UINT8 *ptr, UINT8 *end)
+{
+    UINT64 w;
+    for(;ptr<end && ((UINT64)ptr&7);ptr++)
+        if(ISMAGIC(*ptr)) return ptr;
+    for(;ptr+8<=end;ptr+=8) {
+        w=*((UINT64*)ptr);
+        if(HASBYTE(w,0x7F) || HASBYTE(w,'O') || HASBYTE(w,'M')) break;
+    }
+    for(;ptr<end;ptr++)
+        if(ISMAGIC(*ptr)) return ptr;
+    return end;
+}
+
+/**
+ * address of a kernel page in the initrd if it can be mapped in place, NULL if not
+ */
+UINT8 *CorePage(UINT8 *file, UINT64 offs)
+{
+    UINT8 *ptr=file+offs;
+#ifdef _FS_Z_H_
+    if(fszfrag!=NULL) {
+        ptr=fsz_offset(initrd.ptr,fszfrag,offs);
+        if(ptr==NULL || fsz_offset(initrd.ptr,fszfrag,offs+PAGESIZE-1)!=ptr+PAGESIZE-1)
+            return NULL;
+    }
+#endif
+    return ((UINTN)ptr&(PAGESIZE-1))?NULL:ptr;
+}
+
+/**
+ * copy part of the kernel file
+ */
+VOID CoreRead(UINT8 *dst, UINT8 *file, UINT64 offs, UINT64 len)
+{
+#ifdef _FS_Z_H_
+    if(fszfrag!=NULL) {
+        fsz_read(initrd.ptr,fszfrag,dst,offs,len);
+        return;
+    }
+#endif
+    CopyMem(dst,file+offs,len);
+}
+
 /**
  * Locate and load the kernel in initrd
  */
 EFI_STATUS
 LoadCore()
 {
-    int i=0,bss=0;
+    int i=0,j,bss=0;
+    UINTN k,n;
+    UINT64 offs;
     UINT8 *ptr;
-    core.ptr=ptr=NULL;
-    while(core.ptr==NULL && fsdrivers[i]!=NULL) {
-        core=(*fsdrivers[i++])((unsigned char*)initrd.ptr,kernelname);
-    }
+    ptr=NULL;
+    core=fs_locate((unsigned char*)initrd.ptr,kernelname);
     // if every driver failed, try brute force, scan for the first elf or pe executable
     if(core.ptr==NULL) {
         DBG(L" * Autodetecting kernel%s\n","");
-        i=initrd.size;
-        core.ptr=initrd.ptr;
-        while(i-->0) {
+        ptr=initrd.ptr+(initrd.size>sizeof(Elf64_Ehdr)?initrd.size-sizeof(Elf64_Ehdr):0);
+        for(core.ptr=initrd.ptr;(core.ptr=NextExecutable(core.ptr,ptr))<ptr;core.ptr++) {
             Elf64_Ehdr *ehdr=(Elf64_Ehdr *)(core.ptr);
-            pe_hdr *pehdr=(pe_hdr*)(core.ptr + ((mz_hdr*)(core.ptr))->peaddr);
+            pe_hdr *pehdr;
             if((!CompareMem(ehdr->e_ident,ELFMAG,SELFMAG)||!CompareMem(ehdr->e_ident,"OS/Z",4))&&
                 ehdr->e_ident[EI_CLASS]==ELFCLASS64&&
                 ehdr->e_ident[EI_DATA]==ELFDATA2LSB&&
@@ -527,13 +1115,17 @@ LoadCore()
                 ehdr->e_phnum>0){
                     break;
                 }
-            if(((mz_hdr*)(core.ptr))->magic==MZ_MAGIC && pehdr->magic == PE_MAGIC && 
-                pehdr->machine == IMAGE_FILE_MACHINE_AMD64 && pehdr->file_type == PE_OPT_MAGIC_PE32PLUS) {
+            if(((mz_hdr*)(core.ptr))->magic==MZ_MAGIC && ((mz_hdr*)(core.ptr))->peaddr<initrd.size &&
+                core.ptr+((mz_hdr*)(core.ptr))->peaddr<ptr) {
+                pehdr=(pe_hdr*)(core.ptr + ((mz_hdr*)(core.ptr))->peaddr);
+                if(pehdr->magic == PE_MAGIC && pehdr->machine == IMAGE_FILE_MACHINE_AMD64 &&
+                    pehdr->file_type == PE_OPT_MAGIC_PE32PLUS)
                     break;
-                }
-            core.ptr++;
+            }
         }
-        core.ptr=NULL;
+        if(core.ptr>=ptr)
+            core.ptr=NULL;
+        ptr=NULL;
     }
 
     if(core.ptr!=NULL) {
@@ -545,6 +1137,12 @@ LoadCore()
             // Parse ELF64
             DBG(L" * Parsing ELF64 @%lx\n",core.ptr);
             Elf64_Phdr *phdr=(Elf64_Phdr *)((UINT8 *)ehdr+ehdr->e_phoff);
+#ifdef _FS_Z_H_
+            // program headers of a fragmented file must be in its first sector
+            j=ehdr->e_phoff+ehdr->e_phnum*ehdr->e_phentsize-1;
+            if(fszfrag!=NULL && fsz_offset(initrd.ptr,fszfrag,j)!=core.ptr+j)
+                return report(EFI_LOAD_ERROR,L"Kernel is not a valid executable");
+#endif
             for(i=0;i<ehdr->e_phnum;i++){
                 if(phdr->p_type==PT_LOAD && phdr->p_vaddr>>48==0xffff) {
                     // hack to keep symtab and strtab for shared libraries
@@ -568,14 +1166,32 @@ LoadCore()
         }
         if(ptr==NULL || core.size<2 || entrypoint==0)
             return report(EFI_LOAD_ERROR,L"Kernel is not a valid executable");
-        // create core segment
-        uefi_call_wrapper(BS->AllocatePages, 4, 0, 2,
-            (core.size + bss + PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&core.ptr);
-        if (core.ptr == NULL)
-            return report(EFI_OUT_OF_RESOURCES,L"AllocatePages");
-        CopyMem((void*)core.ptr,ptr,core.size);
-        if(bss>0)
-            ZeroMem((void*)core.ptr + core.size, bss); 
+        n=(core.size+bss+PAGESIZE-1)/PAGESIZE;
+        if(n>COREPAGES)
+            return report(EFI_LOAD_ERROR,L"Kernel is too big");
+        // create core segment. Page aligned data is mapped from the initrd in
+        // place, new memory is only needed for the rest, the partial last page,
+        // holes in fragmented files and the bss
+        offs=ptr-core.ptr;
+        for(k=j=0;k<n;k++) {
+            coremap[k]=(k+1)*PAGESIZE<=core.size?CorePage(core.ptr,offs+k*PAGESIZE):NULL;
+            if(coremap[k]==NULL) j++;
+        }
+        if(j>0) {
+            uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, j, (EFI_PHYSICAL_ADDRESS*)&coretail);
+            if (coretail == NULL)
+                return report(EFI_OUT_OF_RESOURCES,L"AllocatePages");
+            ZeroMem((void*)coretail, j*PAGESIZE);
+        }
+        DBG(L" * Mapped from initrd %d pages\n",n-j);
+        for(k=j=0;k<n;k++)
+            if(coremap[k]==NULL) {
+                coremap[k]=coretail+(j++)*PAGESIZE;
+                if(k*PAGESIZE<core.size)
+                    CoreRead(coremap[k],core.ptr,offs+k*PAGESIZE,
+                        core.size-k*PAGESIZE<PAGESIZE?core.size-k*PAGESIZE:PAGESIZE);
+            }
+        core.ptr=coremap[0];
         core.size += bss;
         DBG(L" * Entry point @%lx, text @%lx %d bytes\n",entrypoint, core.ptr, core.size);
         core.size = ((core.size+PAGESIZE-1)/PAGESIZE)*PAGESIZE;
@@ -732,14 +1348,14 @@ foundinrom:
             status=EFI_LOAD_ERROR;
             RootDir = LibOpenRoot(loaded_image->DeviceHandle);
             // load ramdisk
-            status=LoadFile(initrdfile,&initrd.ptr, &initrd.size);
+            status=LoadInitrd(initrdfile,&initrd.ptr, &initrd.size);
         }
     }
     // if not found, try architecture specific initrd file
     if(EFI_ERROR(status) || initrd.ptr==NULL){
         initrdfile=L"\\BOOTBOOT\\X86_64";
         DBG(L" * Locate initrd in %s\n",initrdfile);
-        status=LoadFile(initrdfile,&initrd.ptr, &initrd.size);
+        status=LoadInitrd(initrdfile,&initrd.ptr, &initrd.size);
     }
     // if even that failed, look for a partition
     if(status!=EFI_SUCCESS || initrd.size==0){
@@ -801,45 +1417,92 @@ partok:
             uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, initrd.size/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&initrd.ptr);
             if (initrd.ptr == NULL)
                 return report(EFI_OUT_OF_RESOURCES,L"AllocatePages");
-            status=bio->ReadBlocks(bio, bio->Media->MediaId, lba_s, initrd.size, initrd.ptr);            
+            status=ReadPartition(bio, lba_s, initrd.ptr, &initrd.size);
         } else
             status=EFI_LOAD_ERROR;
     }
     if(status==EFI_SUCCESS && initrd.size>0){
-        //check if initrd is gzipped
-        if(initrd.ptr[0]==0x1f && initrd.ptr[1]==0x8b){
-            unsigned char *addr,f;
-            int len=0, r;
+        unsigned char *addr=NULL;
+        UINT32 len=0;
+        //check if initrd is gzipped. Seekable images are kept compressed,
+        //files are inflated when they are looked up
+        if(gzix_index(initrd.ptr)!=NULL){
+            DBG(L" * Seekable gzip compressed initrd @%lx %d bytes\n",initrd.ptr,initrd.size);
+            bootboot->x86_64.gzidx_ptr=(UINT64)gzix_index(initrd.ptr);
+        } else if(initrd.ptr[0]==0x1f && initrd.ptr[1]==0x8b){
+            int r;
+            UINT32 crc;
             TINF_DATA d;
             DBG(L" * Gzip compressed initrd @%lx %d bytes\n",initrd.ptr,initrd.size);
-            // skip gzip header
-            addr=initrd.ptr+2;
-            if(*addr++!=8) goto gzerr;
-            f=*addr++; addr+=6;
-            if(f&4) { r=*addr++; r+=(*addr++ << 8); addr+=r; }
-            if(f&8) { while(*addr++ != 0); }
-            if(f&16) { while(*addr++ != 0); }
-            if(f&2) addr+=2;
-            d.source = addr;
-            // allocate destination buffer
-            CopyMem(&len,initrd.ptr+initrd.size-4,4);
+            // concatenated gzip members are inflated on all cores in parallel
+            addr=GzipParallel(&len);
+            if(addr==NULL) {
+                // skip gzip header
+                d.source = GzipData(initrd.ptr);
+                if(d.source==NULL) goto gzerr;
+                d.source_limit = initrd.ptr+initrd.size;
+                // allocate destination buffer
+                CopyMem(&len,initrd.ptr+initrd.size-4,4);
+                uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (len+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&addr);
+                if(addr==NULL)
+                    return report(EFI_OUT_OF_RESOURCES,L"AllocatePages\n");
+                // decompress
+                uzlib_uncompress_init(&d, NULL, 0);
+                d.checksum_type = TINF_CHKSUM_CRC;
+                d.checksum = ~0;
+                r = uzlib_uncompress_buf(&d, addr, len);
+                // verify the gzip trailer's crc32
+                CopyMem(&crc,initrd.ptr+initrd.size-8,4);
+                if (r != TINF_DONE || ~d.checksum != crc)
+                    uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)addr, (len+PAGESIZE-1)/PAGESIZE);
+                if (r != TINF_DONE) {
+gzerr:              return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
+                }
+                if (~d.checksum != crc)
+                    return report(EFI_CRC_ERROR,L"Initrd checksum mismatch");
+            }
+        } else if(initrd.ptr[0]==0x04 && initrd.ptr[1]==0x22 && initrd.ptr[2]==0x4D && initrd.ptr[3]==0x18){
+            //LZ4 frame magic
+            DBG(L" * LZ4 compressed initrd @%lx %d bytes\n",initrd.ptr,initrd.size);
+            // get the uncompressed size, from the frame header if it's recorded
+            if(lz4_uncompress(initrd.ptr, initrd.size, NULL, &len) != LZ4_OK)
+                return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
             uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (len+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&addr);
             if(addr==NULL)
                 return report(EFI_OUT_OF_RESOURCES,L"AllocatePages\n");
-            // decompress
-            d.bitcount = 0;
-            d.bfinal = 0;
-            d.btype = -1;
-            d.dict_size = 0;
-            d.dict_ring = NULL;
-            d.dict_idx = 0;
-            d.curlen = 0;
-            d.dest = addr;
-            d.destSize = len;
-            do { r = uzlib_uncompress(&d); } while (!r);
-            if (r != TINF_DONE) {
-gzerr:          return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
+            if(lz4_uncompress(initrd.ptr, initrd.size, addr, &len) != LZ4_OK) {
+                uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)addr, (len+PAGESIZE-1)/PAGESIZE);
+                return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
+            }
+        } else if(initrd.ptr[0]==0x28 && initrd.ptr[1]==0xB5 && initrd.ptr[2]==0x2F && initrd.ptr[3]==0xFD){
+            //Zstandard frame magic
+            ZSTD_WORK *work=NULL;
+            UINTN np=0;
+            int r;
+            DBG(L" * Zstd compressed initrd @%lx %d bytes\n",initrd.ptr,initrd.size);
+            // the decoder's workspace, the window is the output buffer itself
+            uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (sizeof(ZSTD_WORK)+PAGESIZE-1)/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&work);
+            if(work==NULL)
+                return report(EFI_OUT_OF_RESOURCES,L"AllocatePages\n");
+            // get the uncompressed size, from the frame header if it's recorded
+            r = zstd_uncompress(initrd.ptr, initrd.size, NULL, &len, work);
+            if(r == ZSTD_OK) {
+                np=(len+PAGESIZE-1)/PAGESIZE;
+                uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, np, (EFI_PHYSICAL_ADDRESS*)&addr);
+                if(addr!=NULL)
+                    r = zstd_uncompress(initrd.ptr, initrd.size, addr, &len, work);
             }
+            uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)work, (sizeof(ZSTD_WORK)+PAGESIZE-1)/PAGESIZE);
+            if(r == ZSTD_OK && addr==NULL)
+                return report(EFI_OUT_OF_RESOURCES,L"AllocatePages\n");
+            if(r != ZSTD_OK && addr!=NULL)
+                uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)addr, np);
+            if(r == ZSTD_CHKSUM_ERROR)
+                return report(EFI_CRC_ERROR,L"Initrd checksum mismatch");
+            if(r != ZSTD_OK)
+                return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
+        }
+        if(addr!=NULL) {
             // swap initrd.ptr with the uncompressed buffer
             // if it's not page aligned, we came from ROM, no FreePages
             if(((UINT64)initrd.ptr&(PAGESIZE-1))==0)
@@ -855,10 +1518,7 @@ gzerr:          return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
         }
         if(env.ptr==NULL) {
             // if there were no environment file on boot partition, find it inside the INITRD
-            j=0; ret.ptr=NULL; ret.size=0;
-            while(ret.ptr==NULL && fsdrivers[j]!=NULL) {
-                ret=(*fsdrivers[j++])((unsigned char*)initrd.ptr,cfgname);
-            }
+            ret=fs_locate((unsigned char*)initrd.ptr,cfgname);
             if(ret.ptr!=NULL) {
                 if(ret.size>PAGESIZE-1)
                     ret.size=PAGESIZE-1;
@@ -943,6 +1603,16 @@ gzerr:          return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
         status=LoadCore();
         if (EFI_ERROR(status))
             return status;
+        // pass the initrd's file index to the kernel
+        fidx.size=fs_idxsize();
+        if(fidx.size>0) {
+            uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, fidx.size/PAGESIZE, (EFI_PHYSICAL_ADDRESS*)&fidx.ptr);
+            if(fidx.ptr!=NULL) {
+                fs_export(fidx.ptr);
+                bootboot->x86_64.fidx_ptr=(UINT64)fidx.ptr;
+                DBG(L" * File table @%lx %d files\n",fidx.ptr,((INITRD_IDX*)fidx.ptr)->numfiles);
+            }
+        }
         if(kne!=NULL)
             *kne='\n';
 
@@ -982,7 +1652,7 @@ gzerr:          return report(EFI_COMPROMISED_DATA,L"Unable to uncompress");
         paging[3*512+0]=(UINT64)(bootboot)+1;
         paging[3*512+1]=(UINT64)(env.ptr)+1;
         for(i=0;i<(core.size/PAGESIZE);i++)
-            paging[3*512+2+i]=(UINT64)((UINT8 *)core.ptr+i*PAGESIZE+1);
+            paging[3*512+2+i]=(UINT64)(coremap[i]+1);
         paging[3*512+511]=(UINT64)((UINT8 *)paging+23*PAGESIZE+1);  // core stack
         //identity mapping
         //2M PDPE
@@ -1025,7 +1695,11 @@ get_memory_map:
                  (mement->PhysicalStart <= (UINT64)core.ptr &&
                     mement->PhysicalStart+(mement->NumberOfPages*PAGESIZE) > (UINT64)core.ptr) ||
                  (mement->PhysicalStart <= (UINT64)paging &&
-                    mement->PhysicalStart+(mement->NumberOfPages*PAGESIZE) > (UINT64)paging)
+                    mement->PhysicalStart+(mement->NumberOfPages*PAGESIZE) > (UINT64)paging) ||
+                 (coretail!=NULL && mement->PhysicalStart <= (UINT64)coretail &&
+                    mement->PhysicalStart+(mement->NumberOfPages*PAGESIZE) > (UINT64)coretail) ||
+                 (fidx.ptr!=NULL && mement->PhysicalStart <= (UINT64)fidx.ptr &&
+                    mement->PhysicalStart+(mement->NumberOfPages*PAGESIZE) > (UINT64)fidx.ptr)
                 )) {
                     continue;
             }
@@ -40,91 +40,598 @@ extern int oct2bin(unsigned char *str,int size);
 extern int hex2bin(unsigned char *str,int size);
 extern CHAR16 *a2u (char *str);
 
+/**
+ * directory index of the initrd, path -> file, built in a single pass
+ */
+#define FS_HASHBITS 14
+typedef struct {
+    unsigned char *name;
+    UINT32 len;
+    UINT32 next;      // next entry in the same bucket plus one, 0 at the end
+    file_t file;
+} fsent_t;
+unsigned char *fsindex_p = NULL;    // initrd the index was built for
+UINT32 *fshash = NULL;              // first entry of each bucket plus one
+fsent_t *fsent = NULL;
+UINT32 fsnum = 0, fsmax = 0;
+int fsfail = 0;                     // out of memory, use the drivers' lookup
+UINT32 fsidxbits = 0;                 // bucket bits of the exported file table
+
+/**
+ * length of a name in a fixed size field, which is not always zero terminated
+ */
+UINT32 fs_namelen(unsigned char *s, UINT32 max)
+{
+    UINT32 n=0;
+    while(n<max && s[n]) n++;
+    return n;
+}
+
+/**
+ * FNV-1a hash of a path
+ */
+UINT32 fs_hash(unsigned char *s, UINT32 len)
+{
+    UINT32 h=2166136261U;
+    while(len--) { h^=*s++; h*=16777619U; }
+    return h;
+}
+
+/**
+ * look up a path in the index
+ */
+file_t *fs_find(unsigned char *name, UINT32 len)
+{
+    UINT32 i=fshash[fs_hash(name,len)>>(32-FS_HASHBITS)];
+    while(i) {
+        if(fsent[i-1].len==len && !CompareMem(fsent[i-1].name,name,len))
+            return &fsent[i-1].file;
+        i=fsent[i-1].next;
+    }
+    return NULL;
+}
+
+/**
+ * add a file to the index, if a path is stored twice, the first one wins
+ */
+void fs_add(unsigned char *name, UINT32 len, UINT8 *ptr, UINTN size)
+{
+    fsent_t *ent=NULL;
+    UINT32 h;
+    if(fsfail || len==0 || fs_find(name,len)!=NULL)
+        return;
+    if(fsnum==fsmax) {
+        uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (2*fsmax+1024)*sizeof(fsent_t)/EFI_PAGE_SIZE, (EFI_PHYSICAL_ADDRESS*)&ent);
+        if(ent==NULL) {
+            fsfail=1;
+            return;
+        }
+        if(fsent!=NULL) {
+            CopyMem(ent,fsent,fsmax*sizeof(fsent_t));
+            uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)fsent, fsmax*sizeof(fsent_t)/EFI_PAGE_SIZE);
+        }
+        fsent=ent;
+        fsmax=2*fsmax+1024;
+    }
+    h=fs_hash(name,len)>>(32-FS_HASHBITS);
+    fsent[fsnum].name=name;
+    fsent[fsnum].len=len;
+    fsent[fsnum].next=fshash[h];
+    fsent[fsnum].file.ptr=ptr;
+    fsent[fsnum].file.size=size;
+    fshash[h]=++fsnum;
+}
+
 #ifdef _FS_Z_H_
+FSZ_Inode *fszfrag = NULL;          // inode of the last file found, if it's fragmented
+
+/**
+ * FS/Z pointer to a file offset, walks the sector directory levels. NULL for holes
+ */
+UINT8 *fsz_offset(unsigned char *initrd_p, FSZ_Inode *in, UINT64 offs)
+{
+    FSZ_SuperBlock *sb = (FSZ_SuperBlock *)initrd_p;
+    FSZ_SectorList *sd;
+    UINT64 ss=1<<(sb->logsec+11), n=ss/sizeof(FSZ_SectorList), d, e, max;
+    int l, lvl, t=FSZ_FLAG_TRANSLATION(in->flags);
+    switch(t) {
+        case FSZ_IN_FLAG_INLINE:
+            return (UINT8*)in+1024+offs;
+        case FSZ_IN_FLAG_DIRECT:
+            return initrd_p+in->sec*ss+offs;
+        case FSZ_IN_FLAG_SECLIST:
+            // sector list (extents), only the first one supported
+            return initrd_p+*((UINT64*)&in->inlinedata)*ss+offs;
+        case FSZ_IN_FLAG_SECLIST0:
+            return initrd_p+((FSZ_SectorList *)(initrd_p+in->sec*ss))->sec*ss+offs;
+        case FSZ_IN_FLAG_SDINLINE:
+            sd=(FSZ_SectorList *)&in->inlinedata;
+            max=(ss-1024)/sizeof(FSZ_SectorList);
+            lvl=1;
+            break;
+        default:
+            // sector directory with as many levels as the translation says
+            if(t<FSZ_IN_FLAG_SD || t>=FSZ_IN_FLAG_SDINLINE)
+                return NULL;
+            sd=(FSZ_SectorList *)(initrd_p+in->sec*ss);
+            max=n;
+            lvl=t-FSZ_IN_FLAG_SD+1;
+            break;
+    }
+    for(d=1,l=1;l<lvl;l++)
+        d*=n;
+    e=offs/ss/d;
+    if(e>=max)
+        return NULL;
+    while(1) {
+        if(sd[e].sec==0)
+            return NULL;
+        if(--lvl==0)
+            return initrd_p+sd[e].sec*ss+offs%ss;
+        sd=(FSZ_SectorList *)(initrd_p+sd[e].sec*ss);
+        d/=n;
+        e=(offs/ss/d)%n;
+    }
+}
+
+/**
+ * FS/Z copy part of a possibly fragmented file, holes are read as zeros
+ */
+void fsz_read(unsigned char *initrd_p, FSZ_Inode *in, UINT8 *dst, UINT64 offs, UINT64 len)
+{
+    UINT64 ss=1<<(((FSZ_SuperBlock *)initrd_p)->logsec+11), n;
+    UINT8 *src;
+    while(len>0) {
+        n=ss-offs%ss;
+        if(n>len) n=len;
+        src=fsz_offset(initrd_p,in,offs);
+        if(src!=NULL)
+            CopyMem(dst,src,n);
+        else
+            ZeroMem(dst,n);
+        dst+=n; offs+=n; len-=n;
+    }
+}
+
 /**
  * FS/Z initrd (OS/Z's native file system)
  */
 file_t fsz_initrd(unsigned char *initrd_p, char *kernel)
 {
     FSZ_SuperBlock *sb = (FSZ_SuperBlock *)initrd_p;
-    FSZ_DirEnt *ent;
+    FSZ_DirEntHeader *hdr;
+    FSZ_DirEnt *ent=NULL;
     FSZ_Inode *in=(FSZ_Inode *)(initrd_p+sb->rootdirfid*FSZ_SECSIZE);
     file_t ret = { NULL, 0 };
+    fszfrag=NULL;
     if(initrd_p==NULL || CompareMem(sb->magic,FSZ_MAGIC,4) || kernel==NULL){
         return ret;
     }
     DBG(L" * FS/Z %s\n",a2u(kernel));
-    // Get the inode
-    int i,ss=1<<(sb->logsec+11);
+    UINT64 j,ss=1<<(sb->logsec+11);
     char *s,*e;
     s=e=kernel;
-    i=0;
-again:
-    while(*e!='/'&&*e!=0){e++;}
-    if(*e=='/'){e++;}
-    if(!CompareMem(in->magic,FSZ_IN_MAGIC,4)){
-        //is it inlined?
-        if(!CompareMem(in->inlinedata,FSZ_DIR_MAGIC,4)){
-            ent=(FSZ_DirEnt *)(in->inlinedata);
-        } else if(!CompareMem(initrd_p+in->sec*ss,FSZ_DIR_MAGIC,4)){
-            // go, get the sector pointed
-            ent=(FSZ_DirEnt *)(initrd_p+in->sec*ss);
-        } else {
+    // walk the path, directories may span several sectors too
+    while(1) {
+        while(*e!='/'&&*e!=0){e++;}
+        if(*e=='/'){e++;}
+        if(CompareMem(in->magic,FSZ_IN_MAGIC,4))
+            return ret;
+        hdr=(FSZ_DirEntHeader *)fsz_offset(initrd_p,in,0);
+        if(hdr==NULL || CompareMem(hdr,FSZ_DIR_MAGIC,4))
             return ret;
+        //iterate on directory entries, skip header
+        for(j=1;j<=hdr->numentries;j++) {
+            ent=(FSZ_DirEnt *)fsz_offset(initrd_p,in,j*sizeof(FSZ_DirEnt));
+            if(ent!=NULL && !CompareMem(ent->name,s,e-s))
+                break;
         }
-        //skip header
-        FSZ_DirEntHeader *hdr=(FSZ_DirEntHeader *)ent; ent++;
-        //iterate on directory entries
-        int j=hdr->numentries;
-        while(j-->0){
-            if(!CompareMem(ent->name,s,e-s)) {
-                if(*e==0) {
-                    i=ent->fid;
+        if(j>hdr->numentries)
+            return ret;
+        in=(FSZ_Inode *)(initrd_p+ent->fid*ss);
+        if(*e==0)
+            break;
+        s=e;
+    }
+    // fid -> inode ptr -> data ptr
+    if(!CompareMem(in->magic,FSZ_IN_MAGIC,4)){
+        ret.ptr=fsz_offset(initrd_p,in,0);
+        if(ret.ptr!=NULL) {
+            ret.size=in->size;
+            // the caller has to look up each sector of a fragmented file
+            for(j=ss;j<in->size;j+=ss)
+                if(fsz_offset(initrd_p,in,j)!=ret.ptr+j) {
+                    fszfrag=in;
                     break;
-                } else {
-                    s=e;
-                    in=(FSZ_Inode *)(initrd_p+ent->fid*ss);
-                    goto again;
                 }
-            }
-            ent++;
         }
-    } else {
-        i=0;
     }
-    if(i!=0) {
-        // fid -> inode ptr -> data ptr
-        FSZ_Inode *in=(FSZ_Inode *)(initrd_p+i*ss);
-        if(!CompareMem(in->magic,FSZ_IN_MAGIC,4)){
-            ret.size=in->size;
-            switch(FSZ_FLAG_TRANSLATION(in->flags)) {
-                case FSZ_IN_FLAG_INLINE:
-                    // inline data
-                    ret.ptr=(UINT8*)(initrd_p+i*ss+1024);
-                    break;
-                case FSZ_IN_FLAG_SECLIST:
-                case FSZ_IN_FLAG_SDINLINE:
-                    // sector directory or list inlined
-                    ret.ptr=(UINT8*)(initrd_p + *((UINT64*)&in->inlinedata) * ss);
-                    break;
-                case FSZ_IN_FLAG_DIRECT:
-                    // direct data
-                    ret.ptr=(UINT8*)(initrd_p + in->sec * ss);
-                    break;
-                // sector directory (only one level supported here, and no holes in files)
-                case FSZ_IN_FLAG_SECLIST0:
-                case FSZ_IN_FLAG_SD:
-                    ret.ptr=(UINT8*)(initrd_p + (unsigned int)(((FSZ_SectorList *)(initrd_p+in->sec*ss))->sec) * ss);
-                    break;
-                default:
-                    ret.size=0;
+    return ret;
+}
+#endif
+
+/**
+ * SquashFS 4.0. Only the metadata on the path and the file's own blocks are
+ * uncompressed, the image is passed to the kernel as is
+ */
+#define SQFS_MAGIC      0x73717368
+#define SQFS_GZIP       1
+#define SQFS_LZ4        5
+#define SQFS_ZSTD       6
+#define SQFS_METASIZE   8192
+#define SQFS_UNCOMP     (1<<24)     // data block stored as is
+#define SQFS_NOFRAG     0xFFFFFFFF
+typedef struct {
+    UINT32 magic, inodes, mtime, blocksize, frags;
+    UINT16 comp, blocklog, flags, ids, vmaj, vmin;
+    UINT64 root, used, idtable, xattrtable, inodetable, dirtable, fragtable, exporttable;
+} sqfs_t;
+typedef struct { UINT16 type, mode, uid, gid; UINT32 mtime, ino; } sqfs_inode_t;
+typedef struct { UINT32 start, nlink; UINT16 size, offs; UINT32 parent; } sqfs_dir_t;
+typedef struct { UINT32 nlink, size, start, parent; UINT16 icount, offs; UINT32 xattr; } sqfs_ldir_t;
+typedef struct { UINT32 start, frag, fragoffs, size; } sqfs_file_t;
+typedef struct { UINT64 start, size, sparse; UINT32 nlink, frag, fragoffs, xattr; } sqfs_lfile_t;
+typedef struct { UINT32 count, start, ino; } sqfs_dirhdr_t;
+typedef struct { UINT16 offs, ino, type, namelen; } sqfs_dirent_t;
+UINT8 sqfsmeta[SQFS_METASIZE];         // last uncompressed metadata block
+UINT8 *sqfsmetap = NULL;               // where it was read from
+UINT32 sqfsmetalen = 0;
+ZSTD_WORK *sqfswork = NULL;
+
+/**
+ * memory for an uncompressed file
+ */
+UINT8 *fs_alloc(UINT64 size)
+{
+    UINT8 *ptr=NULL;
+    uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (size+EFI_PAGE_SIZE-1)/EFI_PAGE_SIZE, (EFI_PHYSICAL_ADDRESS*)&ptr);
+    return ptr;
+}
+
+/**
+ * keep the first size bytes of an allocation, free the rest
+ */
+void fs_keep(UINT8 *ptr, UINT64 size, UINT64 total)
+{
+    size=(size+EFI_PAGE_SIZE-1)/EFI_PAGE_SIZE;
+    total=(total+EFI_PAGE_SIZE-1)/EFI_PAGE_SIZE;
+    if(total>size)
+        uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(ptr+size*EFI_PAGE_SIZE), total-size);
+}
+
+/**
+ * uncompress a block, returns its uncompressed size or 0 on error
+ */
+UINT32 sqfs_uncompress(sqfs_t *sb, UINT8 *src, UINT32 len, UINT8 *dst, UINT32 max)
+{
+    TINF_DATA d;
+    unsigned int n=max;
+    switch(sb->comp) {
+        case SQFS_GZIP:
+            // zlib stream, skip its header
+            if(len<2 || (src[0]&0x0F)!=8)
+                return 0;
+            d.source=src+2;
+            d.source_limit=src+len;
+            uzlib_uncompress_init(&d, NULL, 0);
+            if(uzlib_uncompress_buf(&d, dst, max)!=TINF_DONE)
+                return 0;
+            return (UINT8*)d.dest-dst;
+        case SQFS_LZ4:
+            return lz4_uncompress_block(src, len, dst, &n)==LZ4_OK?n:0;
+        case SQFS_ZSTD:
+            if(sqfswork==NULL)
+                uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (sizeof(ZSTD_WORK)+EFI_PAGE_SIZE-1)/EFI_PAGE_SIZE, (EFI_PHYSICAL_ADDRESS*)&sqfswork);
+            if(sqfswork==NULL)
+                return 0;
+            return zstd_uncompress(src, len, dst, &n, sqfswork)==ZSTD_OK?n:0;
+    }
+    return 0;
+}
+
+/**
+ * copy len bytes from a metadata table. blk is the offset of a metadata block in
+ * the image, offs the position in its uncompressed contents, both are advanced
+ */
+int sqfs_meta(unsigned char *initrd_p, sqfs_t *sb, UINT64 *blk, UINT32 *offs, void *dst, UINT32 len)
+{
+    UINT8 *ptr;
+    UINT32 h, n;
+    while(len>0) {
+        if(*blk+2>sb->used)
+            return 0;
+        ptr=initrd_p+*blk;
+        h=ptr[0]|(ptr[1]<<8);
+        if(*blk+2+(h&0x7FFF)>sb->used)
+            return 0;
+        if(ptr!=sqfsmetap) {
+            sqfsmetap=NULL;
+            if(h&0x8000) {
+                sqfsmetalen=h&0x7FFF;
+                if(sqfsmetalen>SQFS_METASIZE)
+                    return 0;
+                CopyMem(sqfsmeta,ptr+2,sqfsmetalen);
+            } else if(!(sqfsmetalen=sqfs_uncompress(sb,ptr+2,h&0x7FFF,sqfsmeta,SQFS_METASIZE)))
+                return 0;
+            sqfsmetap=ptr;
+        }
+        if(*offs>=sqfsmetalen) {
+            *offs-=sqfsmetalen;
+            *blk+=2+(h&0x7FFF);
+            continue;
+        }
+        n=sqfsmetalen-*offs<len?sqfsmetalen-*offs:len;
+        CopyMem(dst,sqfsmeta+*offs,n);
+        dst=(UINT8*)dst+n;
+        *offs+=n;
+        len-=n;
+    }
+    return 1;
+}
+
+file_t sqfs_initrd(unsigned char *initrd_p, char *kernel)
+{
+    sqfs_t *sb=(sqfs_t*)initrd_p;
+    sqfs_inode_t in;
+    sqfs_dir_t dir;
+    sqfs_ldir_t ldir;
+    sqfs_file_t fil;
+    sqfs_lfile_t lfil;
+    sqfs_dirhdr_t dh;
+    sqfs_dirent_t de;
+    UINT64 blk, ref, start, size, pos, i, nb, bs, fblk;
+    UINT32 offs, fboffs, left, frag, fragoffs, w, n, k, found, inplace;
+    UINT8 name[256], *out;
+    char *s, *e;
+    file_t ret = { NULL, 0 };
+    if(initrd_p==NULL || kernel==NULL || sb->magic!=SQFS_MAGIC || sb->vmaj!=4 ||
+        (sb->comp!=SQFS_GZIP && sb->comp!=SQFS_LZ4 && sb->comp!=SQFS_ZSTD) || sb->blocksize<4096 || sb->blocksize>1024*1024)
+        return ret;
+    DBG(L" * SquashFS %s\n",a2u(kernel));
+    sqfsmetap=NULL;
+    bs=sb->blocksize;
+    // walk the path
+    ref=sb->root;
+    for(s=kernel;;s=e+1) {
+        for(e=s;*e!='/' && *e!=0;e++);
+        k=e-s;
+        blk=sb->inodetable+(ref>>16); offs=ref&0xFFFF;
+        if(!sqfs_meta(initrd_p,sb,&blk,&offs,&in,sizeof(in)))
+            return ret;
+        if(in.type==1) {
+            if(!sqfs_meta(initrd_p,sb,&blk,&offs,&dir,sizeof(dir)))
+                return ret;
+            start=dir.start; left=dir.size; offs=dir.offs;
+        } else if(in.type==8) {
+            if(!sqfs_meta(initrd_p,sb,&blk,&offs,&ldir,sizeof(ldir)))
+                return ret;
+            start=ldir.start; left=ldir.size; offs=ldir.offs;
+        } else
+            return ret;
+        // the size counts 3 bytes for the . and .. entries, which are not stored
+        left=left>3?left-3:0;
+        blk=sb->dirtable+start;
+        for(found=0;!found && left>=sizeof(dh);) {
+            if(!sqfs_meta(initrd_p,sb,&blk,&offs,&dh,sizeof(dh)))
+                return ret;
+            left-=sizeof(dh);
+            for(i=0;i<=dh.count && left>=sizeof(de);i++) {
+                if(!sqfs_meta(initrd_p,sb,&blk,&offs,&de,sizeof(de)) || de.namelen>=sizeof(name)-1 ||
+                    de.namelen+1U>left-sizeof(de) || !sqfs_meta(initrd_p,sb,&blk,&offs,name,de.namelen+1))
+                    return ret;
+                left-=sizeof(de)+de.namelen+1;
+                if(de.namelen+1U==k && !CompareMem(name,s,k)) {
+                    ref=((UINT64)dh.start<<16)|de.offs;
+                    found=1;
                     break;
+                }
             }
         }
+        if(!found)
+            return ret;
+        if(*e==0)
+            break;
+    }
+    // file inode
+    blk=sb->inodetable+(ref>>16); offs=ref&0xFFFF;
+    if(!sqfs_meta(initrd_p,sb,&blk,&offs,&in,sizeof(in)))
+        return ret;
+    if(in.type==2) {
+        if(!sqfs_meta(initrd_p,sb,&blk,&offs,&fil,sizeof(fil)))
+            return ret;
+        start=fil.start; size=fil.size; frag=fil.frag; fragoffs=fil.fragoffs;
+    } else if(in.type==9) {
+        if(!sqfs_meta(initrd_p,sb,&blk,&offs,&lfil,sizeof(lfil)))
+            return ret;
+        start=lfil.start; size=lfil.size; frag=lfil.frag; fragoffs=lfil.fragoffs;
+    } else
+        return ret;
+    nb=frag==SQFS_NOFRAG?(size+bs-1)/bs:size/bs;
+    // block sizes follow the inode. If all blocks are stored as is, and
+    // there's no fragment, the file is used in place
+    fblk=blk; fboffs=offs;
+    for(inplace=frag==SQFS_NOFRAG,pos=start,i=0;i<nb;i++) {
+        if(!sqfs_meta(initrd_p,sb,&blk,&offs,&w,4))
+            return ret;
+        if(!(w&SQFS_UNCOMP) || (w&~SQFS_UNCOMP)!=(i+1<nb?bs:size-i*bs))
+            inplace=0;
+        pos+=w&~SQFS_UNCOMP;
+    }
+    if(pos>sb->used)
+        return ret;
+    if(inplace) {
+        ret.ptr=initrd_p+start;
+        ret.size=size;
+        return ret;
+    }
+    // uncompress, with room for a whole block after the file
+    out=fs_alloc(size+bs);
+    if(out==NULL)
+        return ret;
+    blk=fblk; offs=fboffs;
+    for(pos=start,i=0;i<nb;i++) {
+        sqfs_meta(initrd_p,sb,&blk,&offs,&w,4);
+        n=w&~SQFS_UNCOMP;
+        if(n==0)
+            ZeroMem(out+i*bs,bs);
+        else if(w&SQFS_UNCOMP)
+            CopyMem(out+i*bs,initrd_p+pos,n);
+        else if(!sqfs_uncompress(sb,initrd_p+pos,n,out+i*bs,bs))
+            goto err;
+        pos+=n;
+    }
+    // the tail end of the file is in a fragment block with others
+    if(frag!=SQFS_NOFRAG) {
+        if(frag>=sb->frags || sb->fragtable+(frag/512+1)*8>sb->used)
+            goto err;
+        CopyMem(&blk,initrd_p+sb->fragtable+(frag/512)*8,8);
+        offs=(frag%512)*16;
+        if(!sqfs_meta(initrd_p,sb,&blk,&offs,&pos,8) || !sqfs_meta(initrd_p,sb,&blk,&offs,&w,4))
+            goto err;
+        n=w&~SQFS_UNCOMP;
+        if(pos+n>sb->used || fragoffs+size-nb*bs>bs)
+            goto err;
+        if(w&SQFS_UNCOMP)
+            CopyMem(out+nb*bs,initrd_p+pos+fragoffs,size-nb*bs);
+        else {
+            // uncompress the whole fragment after the file and move ours down
+            if(!sqfs_uncompress(sb,initrd_p+pos,n,out+((size+EFI_PAGE_SIZE-1)&~(EFI_PAGE_SIZE-1)),bs))
+                goto err;
+            CopyMem(out+nb*bs,out+((size+EFI_PAGE_SIZE-1)&~(EFI_PAGE_SIZE-1))+fragoffs,size-nb*bs);
+        }
     }
+    fs_keep(out,size,size+bs);
+    ret.ptr=out;
+    ret.size=size;
+    return ret;
+err:
+    fs_keep(out,0,size+bs);
+    return ret;
+}
+
+/**
+ * BOOTBOOT native initrd, its directory is hashed just like the file table
+ * passed to the kernel, so the kernel is found without walking the archive
+ */
+file_t bbfs_initrd(unsigned char *initrd_p, char *kernel)
+{
+    INITRD_IDX *hdr=(INITRD_IDX*)initrd_p;
+    INITRD_BBFS_FILE *file;
+    UINT32 i, e, h, k, *bucket;
+    file_t ret = { NULL, 0 };
+    if(initrd_p==NULL || CompareMem(initrd_p,INITRD_BBFS_MAGIC,4) || hdr->hashbits<1 || hdr->hashbits>24)
+        return ret;
+    DBG(L" * BBFS %s\n",kernel?a2u(kernel):L"index");
+    file=(INITRD_BBFS_FILE*)(initrd_p+hdr->files);
+    bucket=(UINT32*)(initrd_p+sizeof(INITRD_IDX));
+    if(kernel==NULL) {
+        // compressed files are left for the kernel
+        for(i=0;i<hdr->numfiles;i++)
+            if(!file[i].flags)
+                fs_add(initrd_p+file[i].name,fs_namelen(initrd_p+file[i].name,hdr->size-file[i].name),
+                    initrd_p+file[i].offset,file[i].size);
+        return ret;
+    }
+    k=strlena((unsigned char*)kernel);
+    h=fs_hash((unsigned char*)kernel,k);
+    e=bucket[(h>>(32-hdr->hashbits))+1];
+    for(i=bucket[h>>(32-hdr->hashbits)];i<e && i<hdr->numfiles;i++)
+        if(file[i].hash==h && !file[i].flags && !CompareMem(initrd_p+file[i].name,kernel,k+1)) {
+            ret.ptr=(UINT8*)(initrd_p+file[i].offset);
+            ret.size=file[i].size;
+            break;
+        }
+    return ret;
+}
+
+/**
+ * seekable gzip initrd made by mkinitrd -s, see INITRD_GZIDX in bootboot.h.
+ * Returns the index, or NULL if the image is not seekable
+ */
+INITRD_GZIDX *gzix_index(unsigned char *initrd_p)
+{
+    INITRD_GZIDX *idx;
+    // the index is the first subfield of the gzip header's extra field
+    if(initrd_p==NULL || initrd_p[0]!=0x1f || initrd_p[1]!=0x8b || initrd_p[2]!=8 || !(initrd_p[3]&4) ||
+        initrd_p[12]!='B' || initrd_p[13]!='X')
+        return NULL;
+    idx=(INITRD_GZIDX*)(initrd_p+16);
+    if(CompareMem(idx->magic,INITRD_GZIDX_MAGIC,4) || idx->chunk<EFI_PAGE_SIZE || !idx->numchunks ||
+        (UINT64)idx->numchunks*idx->chunk<idx->size ||
+        (UINT64)(initrd_p[14]+(initrd_p[15]<<8))<sizeof(INITRD_GZIDX)+(idx->numchunks+1)*sizeof(UINT32))
+        return NULL;
+    return idx;
+}
+
+/**
+ * inflate the chunks holding size bytes at offs. Returns a pointer to offs in
+ * the uncompressed data, *buf and *len tell the allocation to free or keep
+ */
+UINT8 *gzix_inflate(unsigned char *initrd_p, INITRD_GZIDX *idx, UINT64 offs, UINT64 size, UINT8 **buf, UINT64 *len)
+{
+    UINT32 *co=(UINT32*)((UINT8*)idx+sizeof(INITRD_GZIDX));
+    UINT64 a, b;
+    TINF_DATA d;
+    int r;
+    if(size==0 || offs+size>idx->size)
+        return NULL;
+    a=offs/idx->chunk;
+    b=(offs+size+idx->chunk-1)/idx->chunk;
+    if(co[a]>=co[b])
+        return NULL;
+    *len=(b*idx->chunk<idx->size?b*idx->chunk:idx->size)-a*idx->chunk;
+    *buf=fs_alloc(*len);
+    if(*buf==NULL)
+        return NULL;
+    // the stream was flushed at the chunk boundary, so no earlier data is needed.
+    // Only the last chunk ends with a final block, the others with the flush's
+    // empty stored block, after which the decoder reads past co[b] and fails.
+    // That's fine if the output is complete and all the input was used up
+    d.source=initrd_p+co[a];
+    d.source_limit=initrd_p+co[b];
+    uzlib_uncompress_init(&d, NULL, 0);
+    r=uzlib_uncompress_buf(&d, *buf, *len);
+    if(d.dest!=*buf+*len || (r!=TINF_DONE && d.source!=d.source_limit)) {
+        fs_keep(*buf,0,*len);
+        return NULL;
+    }
+    return *buf+offs-a*idx->chunk;
+}
+
+/**
+ * seekable gzip compressed BOOTBOOT native initrd. Only the directory and the
+ * file's chunks are inflated, the image is passed to the kernel as is
+ */
+file_t gzix_initrd(unsigned char *initrd_p, char *kernel)
+{
+    INITRD_GZIDX *idx=gzix_index(initrd_p);
+    INITRD_IDX hdr;
+    UINT8 *dir, *buf;
+    UINT64 len, offs;
+    file_t ret = { NULL, 0 }, f;
+    if(idx==NULL || kernel==NULL)
+        return ret;
+    DBG(L" * Seekable gzip %s\n",a2u(kernel));
+    // the directory's header tells its size
+    if((dir=gzix_inflate(initrd_p,idx,0,sizeof(INITRD_IDX),&buf,&len))==NULL)
+        return ret;
+    CopyMem(&hdr,dir,sizeof(INITRD_IDX));
+    fs_keep(buf,0,len);
+    if(CompareMem(hdr.magic,INITRD_BBFS_MAGIC,4) || hdr.size<sizeof(INITRD_IDX) ||
+        (dir=gzix_inflate(initrd_p,idx,0,hdr.size,&buf,&len))==NULL)
+        return ret;
+    f=bbfs_initrd(dir,kernel);
+    fs_keep(buf,0,len);
+    if(f.ptr==NULL)
+        return ret;
+    // inflate the file in place of the directory
+    offs=f.ptr-dir;
+    if((ret.ptr=gzix_inflate(initrd_p,idx,offs,f.size,&buf,&len))==NULL)
+        return ret;
+    ret.size=f.size;
+    fs_keep(buf,ret.ptr+ret.size-buf,len);
     return ret;
 }
-#endif
 
 /**
  * cpio archive
@@ -134,16 +641,18 @@ file_t cpio_initrd(unsigned char *initrd_p, char *kernel)
     unsigned char *ptr=initrd_p;
     int k;
     file_t ret = { NULL, 0 };
-    if(initrd_p==NULL || kernel==NULL || 
+    if(initrd_p==NULL ||
         (CompareMem(initrd_p,"070701",6) && CompareMem(initrd_p,"070702",6) && CompareMem(initrd_p,"070707",6)))
         return ret;
-    DBG(L" * cpio %s\n",a2u(kernel));
-    k=strlena((unsigned char*)kernel);
+    DBG(L" * cpio %s\n",kernel?a2u(kernel):L"index");
+    k=kernel?strlena((unsigned char*)kernel):0;
     // hpodc archive
     while(!CompareMem(ptr,"070707",6)){
         int ns=oct2bin(ptr+8*6+11,6);
         int fs=oct2bin(ptr+8*6+11+6,11);
-        if(!CompareMem(ptr+9*6+2*11,kernel,k+1)){
+        if(kernel==NULL)
+            fs_add(ptr+9*6+2*11,fs_namelen(ptr+9*6+2*11,ns),(UINT8*)(ptr+9*6+2*11+ns),fs);
+        else if(!CompareMem(ptr+9*6+2*11,kernel,k+1)){
             ret.size=fs;
             ret.ptr=(UINT8*)(ptr+9*6+2*11+ns);
             return ret;
@@ -154,7 +663,9 @@ file_t cpio_initrd(unsigned char *initrd_p, char *kernel)
     while(!CompareMem(ptr,"07070",5)){
         int fs=hex2bin(ptr+8*6+6,8);
         int ns=hex2bin(ptr+8*11+6,8);
-        if(!CompareMem(ptr+110,kernel,k+1)){
+        if(kernel==NULL)
+            fs_add(ptr+110,fs_namelen(ptr+110,ns),(UINT8*)(ptr+((110+ns+3)/4)*4),fs);
+        else if(!CompareMem(ptr+110,kernel,k+1)){
             ret.size=fs;
             ret.ptr=(UINT8*)(ptr+((110+ns+3)/4)*4);
             return ret;
@@ -172,13 +683,15 @@ file_t tar_initrd(unsigned char *initrd_p, char *kernel)
     unsigned char *ptr=initrd_p;
     int k;
     file_t ret = { NULL, 0 };
-    if(initrd_p==NULL || kernel==NULL || CompareMem(initrd_p+257,"ustar",5))
+    if(initrd_p==NULL || CompareMem(initrd_p+257,"ustar",5))
         return ret;
-    DBG(L" * tar %s\n",a2u(kernel));
-    k=strlena((unsigned char*)kernel);
+    DBG(L" * tar %s\n",kernel?a2u(kernel):L"index");
+    k=kernel?strlena((unsigned char*)kernel):0;
     while(!CompareMem(ptr+257,"ustar",5)){
         int fs=oct2bin(ptr+0x7c,11);
-        if(!CompareMem(ptr,kernel,k+1)){
+        if(kernel==NULL)
+            fs_add(ptr,fs_namelen(ptr,100),(UINT8*)(ptr+512),fs);
+        else if(!CompareMem(ptr,kernel,k+1)){
             ret.size=fs;
             ret.ptr=(UINT8*)(ptr+512);
             return ret;
@@ -196,7 +709,7 @@ file_t sfs_initrd(unsigned char *initrd_p, char *kernel)
     unsigned char *ptr, *end;
     int k,bs,ver;
     file_t ret = { NULL, 0 };
-    if(initrd_p==NULL || kernel==NULL || (CompareMem(initrd_p+0x1AC,"SFS",3) && CompareMem(initrd_p+0x1A6,"SFS",3)))
+    if(initrd_p==NULL || (CompareMem(initrd_p+0x1AC,"SFS",3) && CompareMem(initrd_p+0x1A6,"SFS",3)))
         return ret;
     // 1.0 Brendan's version, 1.10 BenLunt's version
     ver=!CompareMem(initrd_p+0x1A6,"SFS",3)?10:0;
@@ -207,8 +720,8 @@ file_t sfs_initrd(unsigned char *initrd_p, char *kernel)
     // got a Starting Marker Entry?
     if(ptr[0]!=2)
         return ret;
-    DBG(L" * SFS 1.%d %s\n",ver,a2u(kernel));
-    k=strlena((unsigned char*)kernel);
+    DBG(L" * SFS 1.%d %s\n",ver,kernel?a2u(kernel):L"index");
+    k=kernel?strlena((unsigned char*)kernel):0;
     // iterate on index until we reach the end or Volume Identifier
     while(ptr<end && ptr[0]!=0x01){
         ptr+=64;
@@ -216,7 +729,10 @@ file_t sfs_initrd(unsigned char *initrd_p, char *kernel)
         if(ptr[0]!=0x12)
             continue;
         // filename match?
-        if(!CompareMem(ptr+(ver?0x23:0x22),kernel,k+1)){
+        if(kernel==NULL)
+            fs_add(ptr+(ver?0x23:0x22),fs_namelen(ptr+(ver?0x23:0x22),end-ptr),initrd_p + *((UINT64*)&ptr[ver?0x0B:0x0A]) * bs,
+                *((UINTN*)&ptr[ver?0x1B:0x1A]));
+        else if(!CompareMem(ptr+(ver?0x23:0x22),kernel,k+1)){
             ret.size=*((UINTN*)&ptr[ver?0x1B:0x1A]);                 // file_length
             ret.ptr=initrd_p + *((UINT64*)&ptr[ver?0x0B:0x0A]) * bs; // base + start_block * blocksize
             break;
@@ -235,12 +751,14 @@ file_t jamesm_initrd(unsigned char *initrd_p, char *kernel)
     int i,k,nf=*((int*)initrd_p);
     file_t ret = { NULL, 0 };
     // no real magic, so we assume initrd contains at least 2 files...
-    if(initrd_p==NULL || kernel==NULL || initrd_p[2]!=0 || initrd_p[3]!=0 || initrd_p[4]!=0xBF || initrd_p[77]!=0xBF)
+    if(initrd_p==NULL || initrd_p[2]!=0 || initrd_p[3]!=0 || initrd_p[4]!=0xBF || initrd_p[77]!=0xBF)
         return ret;
-    DBG(L" * JamesM %s\n",a2u(kernel));
-    k=strlena((unsigned char*)kernel);
+    DBG(L" * JamesM %s\n",kernel?a2u(kernel):L"index");
+    k=kernel?strlena((unsigned char*)kernel):0;
     for(i=0;i<nf && ptr[0]==0xBF;i++) {
-        if(!CompareMem(ptr+1,kernel,k+1)){
+        if(kernel==NULL)
+            fs_add(ptr+1,fs_namelen(ptr+1,64),*((uint32_t*)(ptr+65)) + initrd_p,*((uint32_t*)(ptr+69)));
+        else if(!CompareMem(ptr+1,kernel,k+1)){
             ret.ptr=*((uint32_t*)(ptr+65)) + initrd_p;
             ret.size=*((uint32_t*)(ptr+69));
         }
@@ -249,6 +767,76 @@ file_t jamesm_initrd(unsigned char *initrd_p, char *kernel)
     return ret;
 }
 
+// first read of a partition holding the initrd, enough for any superblock
+#define FS_HEADSIZE 65536
+
+/**
+ * how much of a partition the file system in it uses, from its first len bytes.
+ * Returns the image size, or 0 if it can't be told. The first *head bytes must be
+ * read, and the rest from *tail to the image end, anything in between is unused.
+ * If *head is bigger than len, read up to that and ask again.
+ */
+UINT64 fs_used(unsigned char *initrd_p, UINT64 len, UINT64 *head, UINT64 *tail)
+{
+    unsigned char *ptr=initrd_p;
+    UINT64 bs, total, data, idx, n;
+    UINT32 i;
+    int o;
+    *head=*tail=0;
+    if(initrd_p==NULL || len<512)
+        return 0;
+#ifdef _FS_Z_H_
+    // FS/Z, everything after the first free sector is unused
+    if(len>=sizeof(FSZ_SuperBlock) && !CompareMem(((FSZ_SuperBlock*)initrd_p)->magic,FSZ_MAGIC,4)) {
+        *head=*tail=((FSZ_SuperBlock*)initrd_p)->freesec<<(((FSZ_SuperBlock*)initrd_p)->logsec+11);
+        return *head;
+    }
+#endif
+    // SFS, reserved blocks and data area at the start, index area at the end
+    if(!CompareMem(initrd_p+0x1AC,"SFS",3) || !CompareMem(initrd_p+0x1A6,"SFS",3)) {
+        // 1.10 has the same fields 6 bytes lower
+        o=!CompareMem(initrd_p+0x1A6,"SFS",3)?6:0;
+        bs=1<<(7+initrd_p[0x1BC-o]);
+        total=*((UINT64*)&initrd_p[0x1B0-o]) * bs;
+        data=(*((UINT32*)&initrd_p[0x1B8-o]) + *((UINT64*)&initrd_p[0x19C-o])) * bs;
+        idx=*((UINT64*)&initrd_p[0x1A4-o]);
+        if(data+idx>total)
+            return 0;
+        *head=data;
+        *tail=(total-idx)&~511;
+        return total;
+    }
+    // BOOTBOOT native, the directory first, then up to the end of the last file
+    if(!CompareMem(initrd_p,INITRD_BBFS_MAGIC,4)) {
+        INITRD_IDX *hdr=(INITRD_IDX*)initrd_p;
+        INITRD_BBFS_FILE *file=(INITRD_BBFS_FILE*)(initrd_p+hdr->files);
+        if(len<hdr->size) {
+            *head=*tail=hdr->size;
+            return *head;
+        }
+        for(n=hdr->size,i=0;i<hdr->numfiles;i++)
+            if(file[i].offset+file[i].size>n)
+                n=file[i].offset+file[i].size;
+        *head=*tail=n;
+        return n;
+    }
+    // SquashFS, the superblock knows it
+    if(((sqfs_t*)initrd_p)->magic==SQFS_MAGIC) {
+        *head=*tail=((sqfs_t*)initrd_p)->used;
+        return *head;
+    }
+    // tar, walk the headers until the end of archive marker
+    if(!CompareMem(initrd_p+257,"ustar",5)) {
+        while(ptr+512<=initrd_p+len && !CompareMem(ptr+257,"ustar",5))
+            ptr+=(((oct2bin(ptr+0x7c,11)+511)/512)+1)*512;
+        // the next header is not read yet
+        n=ptr-initrd_p+(ptr+512>initrd_p+len?512:1024);
+        *head=*tail=n;
+        return n;
+    }
+    return 0;
+}
+
 /**
  * Static file system drivers registry
  */
@@ -256,9 +844,104 @@ file_t (*fsdrivers[]) (unsigned char *, char *) = {
 #ifdef _FS_Z_H_
     fsz_initrd,
 #endif
+    bbfs_initrd,
+    sqfs_initrd,
+    gzix_initrd,
     cpio_initrd,
     tar_initrd,
     sfs_initrd,
     jamesm_initrd,
     NULL
 };
+
+/**
+ * locate a file in the initrd. The first call detects the format and indexes
+ * the whole archive in one pass, lookups are served from the index after.
+ * File systems that can't be indexed fall back to the drivers' own lookup
+ */
+file_t fs_locate(unsigned char *initrd_p, char *name)
+{
+    file_t ret = { NULL, 0 }, *f;
+    int i;
+    if(initrd_p==NULL || name==NULL)
+        return ret;
+    if(fsindex_p!=initrd_p) {
+        fsindex_p=initrd_p;
+        fsnum=fsfail=0;
+        if(fshash==NULL)
+            uefi_call_wrapper(BS->AllocatePages, 4, 0, 2, (1<<FS_HASHBITS)*sizeof(UINT32)/EFI_PAGE_SIZE, (EFI_PHYSICAL_ADDRESS*)&fshash);
+        if(fshash==NULL)
+            fsfail=1;
+        else
+            ZeroMem(fshash,(1<<FS_HASHBITS)*sizeof(UINT32));
+        // drivers index the archive when called without a name
+        for(i=0;!fsfail && fsnum==0 && fsdrivers[i]!=NULL;i++)
+            (*fsdrivers[i])(initrd_p,NULL);
+    }
+    if(!fsfail && fsnum>0) {
+        f=fs_find((unsigned char*)name,strlena((unsigned char*)name));
+        return f!=NULL ? *f : ret;
+    }
+    for(i=0;ret.ptr==NULL && fsdrivers[i]!=NULL;i++)
+        ret=(*fsdrivers[i])(initrd_p,name);
+    return ret;
+}
+
+/**
+ * size of the file table passed to the kernel, 0 if the initrd wasn't indexed
+ */
+UINTN fs_idxsize()
+{
+    UINTN size;
+    UINT32 i;
+    if(fsfail || fsnum==0)
+        return 0;
+    for(fsidxbits=1;fsidxbits<24 && (1U<<fsidxbits)<fsnum;fsidxbits++);
+    size=((sizeof(INITRD_IDX)+((1<<fsidxbits)+1)*sizeof(UINT32)+7)&~7)+fsnum*sizeof(INITRD_FILE);
+    for(i=0;i<fsnum;i++)
+        size+=fsent[i].len+1;
+    return (size+EFI_PAGE_SIZE-1)&~(EFI_PAGE_SIZE-1);
+}
+
+/**
+ * write the file table for the kernel to a page aligned buffer of fs_idxsize()
+ * bytes. Records are sorted into buckets, so lookups need no pointer fixups
+ */
+void fs_export(UINT8 *dst)
+{
+    INITRD_IDX *idx=(INITRD_IDX*)dst;
+    INITRD_FILE *file;
+    UINT32 i, h, b, nb, *bucket=(UINT32*)(dst+sizeof(INITRD_IDX));
+    UINT8 *names;
+    CopyMem(idx->magic,INITRD_IDX_MAGIC,4);
+    idx->size=fs_idxsize();
+    nb=1<<fsidxbits;
+    idx->numfiles=fsnum;
+    idx->hashbits=fsidxbits;
+    idx->files=(sizeof(INITRD_IDX)+(nb+1)*sizeof(UINT32)+7)&~7;
+    idx->names=idx->files+fsnum*sizeof(INITRD_FILE);
+    file=(INITRD_FILE*)(dst+idx->files);
+    names=dst+idx->names;
+    // count the files in each bucket and turn the counts into start indices
+    for(i=0;i<=nb;i++)
+        bucket[i]=0;
+    for(i=0;i<fsnum;i++)
+        bucket[(fs_hash(fsent[i].name,fsent[i].len)>>(32-fsidxbits))+1]++;
+    for(i=0;i<nb;i++)
+        bucket[i+1]+=bucket[i];
+    for(i=0;i<fsnum;i++) {
+        h=fs_hash(fsent[i].name,fsent[i].len);
+        b=bucket[h>>(32-fsidxbits)]++;
+        file[b].hash=h;
+        file[b].name=names-dst;
+        file[b].ptr=(UINT64)fsent[i].file.ptr;
+        file[b].size=fsent[i].file.size;
+        CopyMem(names,fsent[i].name,fsent[i].len);
+        names+=fsent[i].len;
+        *names++=0;
+    }
+    // each bucket's counter stopped at the next one's start, shift them back
+    for(i=nb;i>0;i--)
+        bucket[i]=bucket[i-1];
+    bucket[0]=0;
+}
@@ -0,0 +1,240 @@
+/*
+ * x86_64-efi/lz4.c
+ *
+ * Copyright (C) 2017 bzt (bztsrc@github)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of the BOOTBOOT Protocol package.
+ * @brief Tiny LZ4 frame decoder
+ *
+ */
+
+#include "lz4.h"
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4  668265263U
+#define XXH_PRIME5  374761393U
+
+/* frame descriptor flags */
+#define LZ4_FLG_VERSION   0xC0
+#define LZ4_FLG_BLKSUM    0x10
+#define LZ4_FLG_SIZE      0x08
+#define LZ4_FLG_CHKSUM    0x04
+#define LZ4_FLG_DICTID    0x01
+
+/* read a little endian word from an unaligned address */
+static uint32_t lz4_le32(const unsigned char *p)
+{
+    uint32_t w;
+    __builtin_memcpy(&w, p, 4);
+    return w;
+}
+
+static uint32_t lz4_rotl(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+uint32_t lz4_xxh32(const void *data, unsigned int length, uint32_t seed)
+{
+    const unsigned char *p = data, *end = p + length;
+    uint32_t h, v1, v2, v3, v4;
+
+    if (length >= 16) {
+        v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        v2 = seed + XXH_PRIME2;
+        v3 = seed;
+        v4 = seed - XXH_PRIME1;
+        do {
+            v1 = lz4_rotl(v1 + lz4_le32(p) * XXH_PRIME2, 13) * XXH_PRIME1;
+            v2 = lz4_rotl(v2 + lz4_le32(p + 4) * XXH_PRIME2, 13) * XXH_PRIME1;
+            v3 = lz4_rotl(v3 + lz4_le32(p + 8) * XXH_PRIME2, 13) * XXH_PRIME1;
+            v4 = lz4_rotl(v4 + lz4_le32(p + 12) * XXH_PRIME2, 13) * XXH_PRIME1;
+            p += 16;
+        } while (end - p >= 16);
+        h = lz4_rotl(v1, 1) + lz4_rotl(v2, 7) + lz4_rotl(v3, 12) + lz4_rotl(v4, 18);
+    } else
+        h = seed + XXH_PRIME5;
+    h += length;
+    for (; end - p >= 4; p += 4)
+        h = lz4_rotl(h + lz4_le32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+    while (p < end)
+        h = lz4_rotl(h + *p++ * XXH_PRIME5, 11) * XXH_PRIME1;
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+/* copy len bytes forward, source and destination may overlap */
+static void lz4_copy(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+    uint64_t w;
+
+    if (dst - src >= 8 || src - dst >= 8) {
+        /* no overlap within a word, copy 8 bytes at a time */
+        for (; len >= 8; len -= 8, dst += 8, src += 8) {
+            __builtin_memcpy(&w, src, 8);
+            __builtin_memcpy(dst, &w, 8);
+        }
+    } else if (dst - src == 1) {
+        /* run of the same byte */
+        w = *src * 0x0101010101010101ULL;
+        for (; len >= 8; len -= 8, dst += 8)
+            __builtin_memcpy(dst, &w, 8);
+    }
+    while (len--) *dst++ = *src++;
+}
+
+/* read the extension bytes of a 15 length nibble */
+static int lz4_length(const unsigned char **src, const unsigned char *end, unsigned int *len)
+{
+    unsigned int c;
+
+    if (*len != 15) return LZ4_OK;
+    do {
+        if (*src >= end) return LZ4_DATA_ERROR;
+        c = *(*src)++;
+        if (*len + c < *len) return LZ4_DATA_ERROR;
+        *len += c;
+    } while (c == 255);
+    return LZ4_OK;
+}
+
+/* decompress one block to dst+*pos. Matches may reach back into previous
+   blocks of the same frame, but not before frame start */
+static int lz4_block(const unsigned char *src, const unsigned char *end, unsigned char *dst,
+    unsigned int start, unsigned int *pos, unsigned int size)
+{
+    unsigned int token, len, offs, p = *pos;
+
+    while (src < end) {
+        token = *src++;
+        /* literals */
+        len = token >> 4;
+        if (lz4_length(&src, end, &len) != LZ4_OK || len > (unsigned int)(end - src) || len > size - p)
+            return LZ4_DATA_ERROR;
+        if (dst) lz4_copy(dst + p, src, len);
+        src += len;
+        p += len;
+        /* the last sequence has literals only */
+        if (src == end) break;
+        /* match */
+        if (end - src < 2) return LZ4_DATA_ERROR;
+        offs = src[0] | (src[1] << 8);
+        src += 2;
+        len = token & 15;
+        if (lz4_length(&src, end, &len) != LZ4_OK || size - p < 4 || len > size - p - 4 ||
+            !offs || offs > p - start)
+            return LZ4_DATA_ERROR;
+        len += 4;
+        if (dst) lz4_copy(dst + p, dst + p - offs, len);
+        p += len;
+    }
+    *pos = p;
+    return LZ4_OK;
+}
+
+int lz4_uncompress_block(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen)
+{
+    unsigned int pos = 0;
+    int r = lz4_block(src, src + srclen, dst, 0, &pos, *dstlen);
+
+    *dstlen = pos;
+    return r;
+}
+
+int lz4_uncompress(const unsigned char *src, unsigned int srclen, unsigned char *dst, unsigned int *dstlen)
+{
+    const unsigned char *end = src + srclen, *desc;
+    unsigned int size = dst ? *dstlen : ~0U, pos = 0, start, blk, flg;
+    uint64_t content;
+    int r;
+
+    /* the first frame must be there, anything after the last one is padding */
+    if (srclen < 4 || lz4_le32(src) != LZ4_MAGIC) return LZ4_DATA_ERROR;
+    while (end - src >= 4) {
+        /* skippable frames */
+        if ((lz4_le32(src) & 0xFFFFFFF0) == 0x184D2A50) {
+            if (end - src < 8 || lz4_le32(src + 4) > (unsigned int)(end - src - 8)) return LZ4_DATA_ERROR;
+            src += 8 + lz4_le32(src + 4);
+            continue;
+        }
+        if (lz4_le32(src) != LZ4_MAGIC) break;
+        /* frame descriptor */
+        desc = src + 4;
+        if (end - desc < 3) return LZ4_DATA_ERROR;
+        flg = desc[0];
+        if ((flg & LZ4_FLG_VERSION) != 0x40 || (flg & LZ4_FLG_DICTID)) return LZ4_DATA_ERROR;
+        src = desc + 2;
+        content = 0;
+        if (flg & LZ4_FLG_SIZE) {
+            if (end - src < 9) return LZ4_DATA_ERROR;
+            __builtin_memcpy(&content, src, 8);
+            src += 8;
+        }
+        if (((lz4_xxh32(desc, src - desc, 0) >> 8) & 0xFF) != *src) return LZ4_CHKSUM_ERROR;
+        src++;
+        /* when only the size is asked, no need to decompress the blocks */
+        if (!dst && (flg & LZ4_FLG_SIZE)) {
+            if (content > size - pos) return LZ4_DATA_ERROR;
+            pos += content;
+        }
+        /* data blocks */
+        start = pos;
+        for (;;) {
+            if (end - src < 4) return LZ4_DATA_ERROR;
+            blk = lz4_le32(src);
+            src += 4;
+            if (!blk) break;
+            if (end - src < ((flg & LZ4_FLG_BLKSUM) ? 4 : 0) ||
+                (blk & 0x7FFFFFFF) > (unsigned int)(end - src) - ((flg & LZ4_FLG_BLKSUM) ? 4 : 0))
+                return LZ4_DATA_ERROR;
+            if (!dst && (flg & LZ4_FLG_SIZE)) {
+                /* already accounted for */
+            } else if (blk & 0x80000000) {
+                /* stored block */
+                blk &= 0x7FFFFFFF;
+                if (blk > size - pos) return LZ4_DATA_ERROR;
+                if (dst) lz4_copy(dst + pos, src, blk);
+                pos += blk;
+            } else {
+                r = lz4_block(src, src + blk, dst, start, &pos, size);
+                if (r != LZ4_OK) return r;
+            }
+            src += (blk & 0x7FFFFFFF) + ((flg & LZ4_FLG_BLKSUM) ? 4 : 0);
+        }
+        /* content size and checksum */
+        if (dst && (flg & LZ4_FLG_SIZE) && content != pos - start) return LZ4_DATA_ERROR;
+        if (flg & LZ4_FLG_CHKSUM) {
+            if (end - src < 4) return LZ4_DATA_ERROR;
+            if (dst && lz4_xxh32(dst + start, pos - start, 0) != lz4_le32(src)) return LZ4_CHKSUM_ERROR;
+            src += 4;
+        }
+    }
+    *dstlen = pos;
+    return LZ4_OK;
+}
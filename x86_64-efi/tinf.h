@@ -41,20 +41,30 @@ extern "C" {
 
 /* data structures */
 
+/* number of bits resolved by the first level of the lookup table */
+#define TINF_ROOT_BITS   9
+/* 512 root entries plus worst case second level tables for 288 symbols */
+#define TINF_TABLE_SIZE  1024
+
 typedef struct {
-   unsigned short table[16];  /* table of code length counts */
-   unsigned short trans[288]; /* code -> symbol translation table */
+   unsigned short table[16];   /* table of code length counts */
+   unsigned short fast[TINF_TABLE_SIZE]; /* bit-reversed code -> symbol lookup table */
 } TINF_TREE;
 
 struct TINF_DATA;
 typedef struct TINF_DATA {
    const unsigned char *source;
+   /* End of the source buffer, if set, bits are loaded a word at a time */
+   const unsigned char *source_limit;
    /* If source above is NULL, this function will be used to read
-      next byte from source stream */
+      next byte from source stream. If source_limit is also set, it is
+      called when source reaches it to switch to the next chunk */
    unsigned char (*readSource)(struct TINF_DATA *data);
 
-   unsigned int tag;
+   uint64_t tag;
    unsigned int bitcount;
+   /* zero bytes supplied past the end of the input, a readSource counts its own */
+   unsigned int overrun;
 
     /* Buffer start */
     unsigned char *destStart;
@@ -94,6 +104,7 @@ unsigned char TINFCC uzlib_get_byte(TINF_DATA *d);
 void TINFCC uzlib_init(void);
 void TINFCC uzlib_uncompress_init(TINF_DATA *d, void *dict, unsigned int dictLen);
 int  TINFCC uzlib_uncompress(TINF_DATA *d);
+int  TINFCC uzlib_uncompress_buf(TINF_DATA *d, void *dst, unsigned int len);
 int  TINFCC uzlib_uncompress_chksum(TINF_DATA *d);
 
 int TINFCC uzlib_zlib_parse_header(TINF_DATA *d);